@@ -0,0 +1,79 @@
+#include "Arena.h"
+#include <stdint.h>
+#include <algorithm>
+
+
+/**
+ * Returns the index of the smallest size class that fits size bytes.
+ */
+static int size_class(size_t size)
+{
+    int index = 0;
+    for (size_t class_size = MIN_CLASS_SIZE; class_size < size; class_size <<= 1)
+    {
+        index++;
+    }
+    return index;
+}
+
+
+Arena::Arena(char *memory, size_t size)
+{
+    uintptr_t aligned = ((uintptr_t)memory + ARENA_ALIGNMENT - 1) & ~(uintptr_t)(ARENA_ALIGNMENT - 1);
+    next = (char*)aligned;
+    end = memory + size;
+    chunks = nullptr;
+    std::fill(free_lists, free_lists + SIZE_CLASSES, nullptr);
+}
+
+
+Arena::~Arena()
+{
+    while (chunks != nullptr)
+    {
+        char *chunk = chunks;
+        chunks = *(char**)chunk;
+        delete[] chunk;
+    }
+}
+
+
+void *Arena::alloc(size_t size)
+{
+    int index = size_class(size);
+    // Reuses a freed block of the same size class.
+    if (free_lists[index] != nullptr)
+    {
+        void *block = free_lists[index];
+        free_lists[index] = *(void**)block;
+        return block;
+    }
+    size_t block_size = ARENA_ALIGNMENT + ((size_t)MIN_CLASS_SIZE << index);
+    if ((size_t)(end - next) < block_size)
+    {
+        return nullptr;
+    }
+    // The header before the block keeps its size class for free.
+    *(int*)next = index;
+    void *block = next + ARENA_ALIGNMENT;
+    next += block_size;
+    return block;
+}
+
+
+void Arena::free(void *block)
+{
+    int index = *(int*)((char*)block - ARENA_ALIGNMENT);
+    *(void**)block = free_lists[index];
+    free_lists[index] = block;
+}
+
+
+void Arena::add_chunk(char *chunk, size_t size)
+{
+    *(char**)chunk = chunks;
+    chunks = chunk;
+    // The rest of the previous chunk is abandoned, the first word of this one links the chunks.
+    next = chunk + ARENA_ALIGNMENT;
+    end = chunk + size;
+}
@@ -0,0 +1,53 @@
+#ifndef OS_EX2_ARENA_H
+#define OS_EX2_ARENA_H
+#include <stddef.h>
+
+#define ARENA_ALIGNMENT 16 /* alignment of every block, also the size of the block header */
+#define MIN_CLASS_SIZE 16 /* size of the smallest size class (in bytes) */
+#define SIZE_CLASSES 7 /* number of size classes, the largest is MIN_CLASS_SIZE << (SIZE_CLASSES - 1) */
+
+
+/**
+ * Allocator owned by a single thread. Blocks are rounded up to a power-of-two size class, carved
+ * from the end of the current chunk, and recycled through a free list per size class. Nothing is
+ * returned to the heap until the arena is destroyed.
+ */
+class Arena
+{
+    private:
+        char *next;     // The start of the unused part of the current chunk.
+        char *end;      // The end of the current chunk.
+        char *chunks;   // Chunks added by add_chunk, linked through their first word.
+        void *free_lists[SIZE_CLASSES];     // Freed blocks of each size class, linked through their first word.
+
+    public:
+
+        /**
+         * Constructor for an arena whose first chunk is the given memory, which it does not own.
+         */
+        Arena(char *memory, size_t size);
+
+        /**
+         * Destructor for an arena. Releases every chunk added by add_chunk.
+         */
+        ~Arena();
+
+        /**
+         * Allocates a block of at least size bytes, where size is at most the largest size class.
+         * Returns nullptr if the current chunk has no room for it.
+         */
+        void *alloc(size_t size);
+
+        /**
+         * Returns a block allocated by this arena to the free list of its size class.
+         */
+        void free(void *block);
+
+        /**
+         * Makes the given heap memory, allocated with new[], the current chunk. The arena owns it.
+         */
+        void add_chunk(char *chunk, size_t size);
+};
+
+
+#endif //OS_EX2_ARENA_H
@@ -0,0 +1,66 @@
+#include "Inbox.h"
+
+#define INBOX_MASK (INBOX_SIZE - 1)
+
+static_assert((INBOX_SIZE & INBOX_MASK) == 0, "INBOX_SIZE must be a power of two");
+
+
+Inbox::Inbox(): tail(0), head(0)
+{
+    for (unsigned int i=0; i<INBOX_SIZE; i++)
+    {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+
+bool Inbox::push(const InboxRequest &request)
+{
+    unsigned int position = tail.load(std::memory_order_relaxed);
+    while (true)
+    {
+        Slot &slot = slots[position & INBOX_MASK];
+        int diff = (int)(slot.sequence.load(std::memory_order_acquire) - position);
+        // If the slot is free for this position, tries to claim it.
+        if (diff == 0)
+        {
+            if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+            {
+                slot.request = request;
+                slot.sequence.store(position + 1, std::memory_order_release);
+                return true;
+            }
+        }
+        // If the consumer did not read the request a full lap ago yet.
+        else if (diff < 0)
+        {
+            return false;
+        }
+        // Another producer claimed the position first.
+        else
+        {
+            position = tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+
+bool Inbox::pop(InboxRequest &request)
+{
+    Slot &slot = slots[head & INBOX_MASK];
+    if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+    {
+        return false;
+    }
+    request = slot.request;
+    // Frees the slot for the position a lap ahead.
+    slot.sequence.store(head + INBOX_SIZE, std::memory_order_release);
+    head++;
+    return true;
+}
+
+
+bool Inbox::empty() const
+{
+    return slots[head & INBOX_MASK].sequence.load(std::memory_order_acquire) != head + 1;
+}
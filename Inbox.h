@@ -0,0 +1,68 @@
+#ifndef OS_EX2_INBOX_H
+#define OS_EX2_INBOX_H
+#include <atomic>
+
+#define INBOX_SIZE 256 /* number of requests the inbox holds, a power of two */
+
+
+// Kinds of requests other pthreads can make to the scheduler.
+enum RequestType {SPAWN_REQUEST, RESUME_REQUEST};
+
+
+/**
+ * A request made to the scheduler from outside of it.
+ */
+struct InboxRequest
+{
+    RequestType type;
+    void (*f)(void);    // The entry point of a SPAWN_REQUEST.
+    int tid;    // The thread ID of a RESUME_REQUEST.
+};
+
+
+/**
+ * Bounded lock-free queue of requests, with many producers and a single consumer. Producers may be
+ * any pthread or a signal handler, and never wait for each other or for the consumer.
+ */
+class Inbox
+{
+    private:
+        struct Slot
+        {
+            // Equals the position a producer may claim the slot for, or that position + 1 once the
+            // request in it is published.
+            std::atomic<unsigned int> sequence;
+            InboxRequest request;
+        };
+
+        Slot slots[INBOX_SIZE];
+        std::atomic<unsigned int> tail;     // The next position producers claim.
+        unsigned int head;      // The next position the consumer reads.
+
+    public:
+
+        /**
+         * Constructor for an empty inbox.
+         */
+        Inbox();
+
+        /**
+         * Adds a request to the inbox. Safe to call from any pthread and from signal handlers.
+         * Returns false if the inbox is full.
+         */
+        bool push(const InboxRequest &request);
+
+        /**
+         * Takes the oldest published request out of the inbox. Must only be called by the scheduler.
+         * Returns false if there is none.
+         */
+        bool pop(InboxRequest &request);
+
+        /**
+         * Returns whether there is no published request to take. Must only be called by the scheduler.
+         */
+        bool empty() const;
+};
+
+
+#endif //OS_EX2_INBOX_H
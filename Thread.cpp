@@ -1,14 +1,16 @@
 #include "thread.h"
 #include "uthreads.h"
 #include "blackbox.h"
+#include <algorithm>
 
 
-Thread::Thread(int id, void (*f)(void)): id(id), f(f)
+Thread::Thread(int id, void (*start)(void), char *stack, unsigned int stack_size): id(id), f(nullptr), arg(nullptr),
+                                                                                stack(stack),
+                                                                                arena(stack + stack_size, ARENA_SIZE)
 {
     state = READY;
-    stack = new char[STACK_SIZE];
-    address_t sp = (address_t)stack + STACK_SIZE - sizeof(address_t);
-    address_t pc = (address_t)f;
+    address_t sp = (address_t)stack + stack_size - sizeof(address_t);
+    address_t pc = (address_t)start;
     sigsetjmp(env, 1);
     (env->__jmpbuf)[JB_SP] = translate_address(sp);
     (env->__jmpbuf)[JB_PC] = translate_address(pc);
@@ -18,20 +20,54 @@ Thread::Thread(int id, void (*f)(void)): id(id), f(f)
         exit(1);
     }
     quantum_count = 0;
+    priority = DEFAULT_PRIORITY;
+    level = DEFAULT_PRIORITY;
+    deadline = NO_DEADLINE;
+    deadline_budget = 0;
+    deadline_misses = 0;
+    quantum = DEFAULT_QUANTUM;
+    quantum_scale = 0;
+    std::fill(local_slots, local_slots + INLINE_LOCAL_SLOTS, nullptr);
+    overflow_slots = nullptr;
+    detached = false;
+    explicitly_blocked = false;
+    exit_value = nullptr;
+    joining = NO_THREAD;
+    join_result = nullptr;
+    joined_id = nullptr;
+    mxcsr = 0;
+    x87_control = 0;
 }
 
 
-Thread::Thread(int id): id(id)
+Thread::Thread(int id, char *stack, unsigned int stack_size): id(id), f(nullptr), arg(nullptr), stack(stack),
+                                                              arena(stack + stack_size, ARENA_SIZE)
 {
     // No need to call sigsetjmp since this will be done when the main thread is switched for the first time.
-    stack = new char[STACK_SIZE];
     quantum_count = 1;
+    priority = DEFAULT_PRIORITY;
+    level = DEFAULT_PRIORITY;
+    deadline = NO_DEADLINE;
+    deadline_budget = 0;
+    deadline_misses = 0;
+    quantum = DEFAULT_QUANTUM;
+    quantum_scale = 0;
+    std::fill(local_slots, local_slots + INLINE_LOCAL_SLOTS, nullptr);
+    overflow_slots = nullptr;
+    detached = false;
+    explicitly_blocked = false;
+    exit_value = nullptr;
+    joining = NO_THREAD;
+    join_result = nullptr;
+    joined_id = nullptr;
+    mxcsr = 0;
+    x87_control = 0;
 }
 
 
 Thread::~Thread()
 {
-    delete stack;
+    delete[] overflow_slots;
 }
 
 
@@ -47,12 +83,61 @@ State Thread::getState() const
 }
 
 
+char *Thread::getStack()
+{
+    return stack;
+}
+
+
 int Thread::getId() const
 {
     return id;
 }
 
 
+void Thread::set_entry(void (*f)(void *), void *arg)
+{
+    this->f = f;
+    this->arg = arg;
+}
+
+
+void Thread::run()
+{
+    f(arg);
+}
+
+
+void *Thread::get_closure()
+{
+    return closure;
+}
+
+
+Arena *Thread::get_arena()
+{
+    return &arena;
+}
+
+
+void Thread::save_extended_state()
+{
+#ifdef __x86_64__
+    // The vector registers, including the AVX, opmask and ZMM ones, are caller-saved across the
+    // library call that switches, so only the control registers must survive it.
+    asm volatile("stmxcsr %0\n\tfnstcw %1" : "=m" (mxcsr), "=m" (x87_control));
+#endif
+}
+
+
+void Thread::restore_extended_state()
+{
+#ifdef __x86_64__
+    asm volatile("ldmxcsr %0\n\tfldcw %1" : : "m" (mxcsr), "m" (x87_control));
+#endif
+}
+
+
 sigjmp_buf* Thread::getEnv()
 {
     return &env;
@@ -68,4 +153,193 @@ int Thread::get_quantum_count()
 void Thread::inc_quantum_count()
 {
     quantum_count++;
+}
+
+
+int Thread::get_priority() const
+{
+    return priority;
+}
+
+
+void Thread::set_priority(int priority)
+{
+    this->priority = priority;
+    level = priority;
+}
+
+
+int Thread::get_level() const
+{
+    return level;
+}
+
+
+void Thread::set_level(int level)
+{
+    this->level = level;
+}
+
+
+bool Thread::has_deadline() const
+{
+    return deadline != NO_DEADLINE;
+}
+
+
+long long Thread::get_deadline() const
+{
+    return deadline;
+}
+
+
+void Thread::set_deadline(long long deadline)
+{
+    this->deadline = deadline;
+}
+
+
+int Thread::get_deadline_budget() const
+{
+    return deadline_budget;
+}
+
+
+void Thread::set_deadline_budget(int budget)
+{
+    deadline_budget = budget;
+}
+
+
+int Thread::get_deadline_misses() const
+{
+    return deadline_misses;
+}
+
+
+void Thread::inc_deadline_misses()
+{
+    deadline_misses++;
+}
+
+
+int Thread::get_quantum() const
+{
+    return quantum;
+}
+
+
+void Thread::set_quantum(int quantum)
+{
+    this->quantum = quantum;
+}
+
+
+int Thread::get_quantum_scale() const
+{
+    return quantum_scale;
+}
+
+
+void Thread::set_quantum_scale(int scale)
+{
+    quantum_scale = scale;
+}
+
+
+void *Thread::get_local(int key) const
+{
+    if (key < INLINE_LOCAL_SLOTS)
+    {
+        return local_slots[key];
+    }
+    return overflow_slots == nullptr ? nullptr : overflow_slots[key - INLINE_LOCAL_SLOTS];
+}
+
+
+void Thread::set_local(int key, void *value)
+{
+    if (key < INLINE_LOCAL_SLOTS)
+    {
+        local_slots[key] = value;
+        return;
+    }
+    if (overflow_slots == nullptr)
+    {
+        overflow_slots = new void*[MAX_LOCAL_KEYS - INLINE_LOCAL_SLOTS]();
+    }
+    overflow_slots[key - INLINE_LOCAL_SLOTS] = value;
+}
+
+
+bool Thread::is_detached() const
+{
+    return detached;
+}
+
+
+void Thread::set_detached()
+{
+    detached = true;
+}
+
+
+bool Thread::is_explicitly_blocked() const
+{
+    return explicitly_blocked;
+}
+
+
+void Thread::set_explicitly_blocked(bool blocked)
+{
+    explicitly_blocked = blocked;
+}
+
+
+void *Thread::get_exit_value() const
+{
+    return exit_value;
+}
+
+
+void Thread::set_exit_value(void *value)
+{
+    exit_value = value;
+}
+
+
+std::vector<int> &Thread::get_waiters()
+{
+    return waiters;
+}
+
+
+int Thread::get_joining() const
+{
+    return joining;
+}
+
+
+void **Thread::get_join_result()
+{
+    return join_result;
+}
+
+
+void Thread::set_joining(int tid, void **result)
+{
+    joining = tid;
+    join_result = result;
+}
+
+
+int *Thread::get_joined_id()
+{
+    return joined_id;
+}
+
+
+void Thread::set_joined_id(int *id)
+{
+    joined_id = id;
 }
\ No newline at end of file
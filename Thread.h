@@ -6,7 +6,14 @@
 #define THREAD_H
 #include <setjmp.h>
 #include <signal.h>
+#include <vector>
 #include "general.h"
+#include "uthreads.h"
+#include "Arena.h"
+
+#ifndef INLINE_LOCAL_SLOTS
+#define INLINE_LOCAL_SLOTS 8 /* number of thread-local slots stored inside the thread itself */
+#endif
 
 
 class Thread
@@ -14,25 +21,47 @@ class Thread
     private:
         int id;
         State state;
-        void (*f)(void);
+        void (*f)(void *);  // The function the thread runs, called with arg.
+        void *arg;
+        alignas(UTHREAD_CLOSURE_ALIGNMENT) char closure[UTHREAD_CLOSURE_SIZE];  // Inline storage for arg.
         char *stack;
         sigjmp_buf env;
         int quantum_count;
+        int priority;   // The highest level the thread may reach by blocking itself.
+        int level;  // The current scheduling level, 0 is the highest.
+        long long deadline;     // Deadline of the current job in library time, or NO_DEADLINE.
+        int deadline_budget;    // Quanta the current job may still run ahead of threads without a deadline.
+        int deadline_misses;
+        int quantum;    // The quantum length of the thread, or DEFAULT_QUANTUM for the library's.
+        int quantum_scale;  // Log2 of the adaptive quantum factor, lowered by blocking early.
+        void *local_slots[INLINE_LOCAL_SLOTS];
+        void **overflow_slots;  // Allocated on the first write to a key beyond the inline slots.
+        bool detached;
+        bool explicitly_blocked;    // Whether uthread_block blocked the thread, so only uthread_resume wakes it.
+        void *exit_value;
+        std::vector<int> waiters;   // IDs of the threads waiting to join this thread.
+        int joining;    // The ID of the thread this thread is waiting to join, NO_THREAD or ANY_THREAD.
+        void **join_result;     // Where the exit value of the joined thread is delivered.
+        int *joined_id;     // Where the ID of the joined thread is delivered, when joining any thread.
+        Arena arena;    // Allocates from the ARENA_SIZE bytes right after the stack.
+        unsigned int mxcsr;     // SSE control and status, saved on every voluntary switch.
+        unsigned short x87_control;     // x87 control word, saved on every voluntary switch.
 
     public:
 
         /**
-         * Constructor for a thread.
+         * Constructor for a thread, which starts running at the function start. The stack is
+         * stack_size bytes followed by ARENA_SIZE bytes for the arena, and is not owned by the thread.
          */
-        Thread(int id, void (*f)(void));
+        Thread(int id, void (*start)(void), char *stack, unsigned int stack_size);
 
         /**
-         * Constructor for the main thread.
+         * Constructor for the main thread, which only uses the ARENA_SIZE bytes after stack_size.
          */
-        Thread(int tid);
+        Thread(int tid, char *stack, unsigned int stack_size);
 
         /**
-         * Destructor for a thread.
+         * Destructor for a thread, the stack is released by its owner.
          */
         ~Thread();
 
@@ -56,6 +85,38 @@ class Thread
          */
         char *getStack();
 
+        /**
+         * Setter for the function the thread runs and its argument.
+         */
+        void set_entry(void (*f)(void *), void *arg);
+
+        /**
+         * Runs the function of the thread.
+         */
+        void run();
+
+        /**
+         * Getter for the inline storage of UTHREAD_CLOSURE_SIZE bytes, which the argument may point to.
+         */
+        void *get_closure();
+
+        /**
+         * Getter for the thread's arena.
+         */
+        Arena *get_arena();
+
+        /**
+         * Saves the floating point control registers of the running thread before a voluntary
+         * switch. A thread preempted by the timer signal is not saved here, the kernel keeps its
+         * whole extended state in the signal frame and restores it when the handler returns.
+         */
+        void save_extended_state();
+
+        /**
+         * Restores the state saved by save_extended_state, once the thread runs again.
+         */
+        void restore_extended_state();
+
         /**
          * Getter for thread env.
          */
@@ -70,6 +131,151 @@ class Thread
          * Increments the quantum count.
          */
         void inc_quantum_count();
+
+        /**
+         * Getter for priority.
+         */
+        int get_priority() const;
+
+        /**
+         * Setter for priority. Also moves the thread to the level of the priority.
+         */
+        void set_priority(int priority);
+
+        /**
+         * Getter for scheduling level.
+         */
+        int get_level() const;
+
+        /**
+         * Setter for scheduling level.
+         */
+        void set_level(int level);
+
+        /**
+         * Checks if the thread has a deadline.
+         */
+        bool has_deadline() const;
+
+        /**
+         * Getter for deadline.
+         */
+        long long get_deadline() const;
+
+        /**
+         * Setter for deadline, NO_DEADLINE removes it.
+         */
+        void set_deadline(long long deadline);
+
+        /**
+         * Getter for the deadline budget.
+         */
+        int get_deadline_budget() const;
+
+        /**
+         * Setter for the deadline budget.
+         */
+        void set_deadline_budget(int budget);
+
+        /**
+         * Getter for the number of missed deadlines.
+         */
+        int get_deadline_misses() const;
+
+        /**
+         * Increments the number of missed deadlines.
+         */
+        void inc_deadline_misses();
+
+        /**
+         * Getter for quantum length.
+         */
+        int get_quantum() const;
+
+        /**
+         * Setter for quantum length, DEFAULT_QUANTUM uses the library's.
+         */
+        void set_quantum(int quantum);
+
+        /**
+         * Getter for adaptive quantum scale.
+         */
+        int get_quantum_scale() const;
+
+        /**
+         * Setter for adaptive quantum scale.
+         */
+        void set_quantum_scale(int scale);
+
+        /**
+         * Getter for the thread-local value of a key. Returns nullptr if it was never set.
+         */
+        void *get_local(int key) const;
+
+        /**
+         * Setter for the thread-local value of a key.
+         */
+        void set_local(int key, void *value);
+
+        /**
+         * Getter for the detached flag.
+         */
+        bool is_detached() const;
+
+        /**
+         * Marks the thread as detached, so it is released as soon as it exits.
+         */
+        void set_detached();
+
+        /**
+         * Getter for the explicitly blocked flag.
+         */
+        bool is_explicitly_blocked() const;
+
+        /**
+         * Setter for the explicitly blocked flag.
+         */
+        void set_explicitly_blocked(bool blocked);
+
+        /**
+         * Getter for the exit value.
+         */
+        void *get_exit_value() const;
+
+        /**
+         * Setter for the exit value.
+         */
+        void set_exit_value(void *value);
+
+        /**
+         * Getter for the IDs of the threads waiting to join this thread.
+         */
+        std::vector<int> &get_waiters();
+
+        /**
+         * Getter for the ID of the thread being joined.
+         */
+        int get_joining() const;
+
+        /**
+         * Getter for the location the exit value of the joined thread is delivered to.
+         */
+        void **get_join_result();
+
+        /**
+         * Setter for the thread being joined and the location its exit value is delivered to.
+         */
+        void set_joining(int tid, void **result);
+
+        /**
+         * Getter for the location the ID of the joined thread is delivered to.
+         */
+        int *get_joined_id();
+
+        /**
+         * Setter for the location the ID of the joined thread is delivered to.
+         */
+        void set_joined_id(int *id);
 };
 
 
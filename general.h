@@ -19,6 +19,11 @@ enum State {READY, RUNNING, BLOCKED, TERMINATED};
 
 #define SUCCESS_CODE 0
 #define FAIL_CODE -1
+#define NO_THREAD -1
+#define ANY_THREAD -2
+#define DEFAULT_PRIORITY 0
+#define NO_DEADLINE 0
+#define DEFAULT_QUANTUM 0
 #define SYS_ERROR_MSG "system error: "
 #define LIB_ERROR_MSG "thread library error: "
 
@@ -0,0 +1,908 @@
+#ifndef OS_EX2_SCHEDULER_H
+#define OS_EX2_SCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include "thread.h"
+#include "general.h"
+
+// The scheduler core, a template over the policies that a program may want to specialize:
+//
+//  - QueuePolicy orders the READY threads. It is constructed with the thread table, and provides
+//    push(tid), remove(tid), pop(pick), empty(), remove_if(marked), for_each(f), the scheduling
+//    hooks preempted(thread), suspended(thread) and quantum_started(total_quanta), and the
+//    constants levels (the number of priority levels) and deadlines (whether it orders threads
+//    with a deadline ahead of the others).
+//  - StackProvider allocates the memory of a thread, with allocate(extra) returning a stack of
+//    StackProvider::size bytes followed by extra bytes, and release(memory).
+//  - TimerBackend measures quanta and raises TimerBackend::signal when one is over, with arm(quantum),
+//    arm_margin(usecs), now(), advance(ticks, quantum), next_position(size) and is_simulated().
+//  - StatsSink is told about every quantum that starts, by quantum_started(tid, total_quanta).
+//
+// A policy that is not used costs nothing: every hook of the default policies is an inline member,
+// and the ones that do nothing are dropped by the compiler.
+
+#define ENV_SAVE_CODE 0
+#define ENV_LOAD_CODE 1
+#define SEC_TO_MICROSECS 1000000
+#define MAX_QUANTUM_SCALE 2     // Adaptive quanta range from a quarter to 4 times the thread's quantum.
+
+
+/**
+ * Round-robin over a single queue. Threads keep the default level, and nothing is aged.
+ */
+class round_robin_queue
+{
+    private:
+        std::deque<int> queue;
+
+    public:
+        static const int levels = 1;
+        static const bool deadlines = false;
+
+        explicit round_robin_queue(Thread **) {}
+
+        void push(int tid)
+        {
+            queue.push_back(tid);
+        }
+
+        bool remove(int tid)
+        {
+            std::deque<int>::iterator it = std::find(queue.begin(), queue.end(), tid);
+            if (it == queue.end())
+            {
+                return false;
+            }
+            queue.erase(it);
+            return true;
+        }
+
+        /**
+         * Removes and returns the thread at the position pick(size) chooses, the queue must not be empty.
+         */
+        template <typename Pick>
+        int pop(Pick pick)
+        {
+            unsigned int pos = pick(queue.size());
+            int tid = queue[pos];
+            queue.erase(queue.begin() + pos);
+            return tid;
+        }
+
+        bool empty() const
+        {
+            return queue.empty();
+        }
+
+        /**
+         * Removes every thread whose entry in marked is true, in a single pass.
+         */
+        void remove_if(const bool *marked)
+        {
+            queue.erase(std::remove_if(queue.begin(), queue.end(), [marked](int tid) { return marked[tid]; }),
+                        queue.end());
+        }
+
+        template <typename F>
+        void for_each(F f) const
+        {
+            std::for_each(queue.begin(), queue.end(), f);
+        }
+
+        void preempted(Thread *) {}
+
+        void suspended(Thread *) {}
+
+        void quantum_started(int) {}
+};
+
+
+/**
+ * A ready queue for each of Levels levels, 0 is the highest. A thread that uses its whole quantum
+ * moves down a level, one that blocks early moves up, but not above its priority, and every
+ * AgingPeriod quanta all waiting threads move up a level so low levels are not starved.
+ */
+template <int Levels, int AgingPeriod>
+class mlfq_queue
+{
+    static_assert(Levels >= 1 && Levels <= 32, "ready levels must fit in the level bitmap");
+
+    private:
+        Thread **threads;
+        std::deque<int> queues[Levels];
+        unsigned int nonempty;  // Bitmap of the levels whose queue is not empty.
+
+        void erased_from(int level)
+        {
+            if (queues[level].empty())
+            {
+                nonempty &= ~(1u << level);
+            }
+        }
+
+    public:
+        static const int levels = Levels;
+        static const bool deadlines = false;
+
+        explicit mlfq_queue(Thread **threads) : threads(threads), nonempty(0) {}
+
+        void push(int tid)
+        {
+            int level = threads[tid]->get_level();
+            queues[level].push_back(tid);
+            nonempty |= 1u << level;
+        }
+
+        bool remove(int tid)
+        {
+            int level = threads[tid]->get_level();
+            std::deque<int> &queue = queues[level];
+            std::deque<int>::iterator it = std::find(queue.begin(), queue.end(), tid);
+            if (it == queue.end())
+            {
+                return false;
+            }
+            queue.erase(it);
+            erased_from(level);
+            return true;
+        }
+
+        /**
+         * Removes and returns the thread at the position pick(size) chooses in the highest level
+         * with ready threads. The queues must not be all empty.
+         */
+        template <typename Pick>
+        int pop(Pick pick)
+        {
+            int level = __builtin_ctz(nonempty);
+            std::deque<int> &queue = queues[level];
+            unsigned int pos = pick(queue.size());
+            int tid = queue[pos];
+            queue.erase(queue.begin() + pos);
+            erased_from(level);
+            return tid;
+        }
+
+        bool empty() const
+        {
+            return nonempty == 0;
+        }
+
+        /**
+         * Removes every thread whose entry in marked is true, in a single pass over each level.
+         */
+        void remove_if(const bool *marked)
+        {
+            for (int level=0; level<Levels; level++)
+            {
+                std::deque<int> &queue = queues[level];
+                queue.erase(std::remove_if(queue.begin(), queue.end(), [marked](int tid) { return marked[tid]; }),
+                            queue.end());
+                erased_from(level);
+            }
+        }
+
+        template <typename F>
+        void for_each(F f) const
+        {
+            for (int level=0; level<Levels; level++)
+            {
+                std::for_each(queues[level].begin(), queues[level].end(), f);
+            }
+        }
+
+        void preempted(Thread *thread)
+        {
+            thread->set_level(std::min(thread->get_level() + 1, Levels - 1));
+        }
+
+        void suspended(Thread *thread)
+        {
+            thread->set_level(std::max(thread->get_level() - 1, thread->get_priority()));
+        }
+
+        /**
+         * Moves every waiting thread one level up once every AgingPeriod quanta.
+         */
+        void quantum_started(int total_quanta)
+        {
+            if (total_quanta % AgingPeriod != 0)
+            {
+                return;
+            }
+            for (int level=1; level<Levels; level++)
+            {
+                std::deque<int> &queue = queues[level];
+                for (unsigned int i=0; i<queue.size(); i++)
+                {
+                    threads[queue[i]]->set_level(level - 1);
+                }
+                queues[level - 1].insert(queues[level - 1].end(), queue.begin(), queue.end());
+                queue.clear();
+            }
+            // Every level moved up by one, and level 0 kept its own threads.
+            nonempty = (nonempty >> 1) | (nonempty & 1u);
+        }
+};
+
+
+/**
+ * Earliest-deadline-first ahead of the Levels policy. A thread whose job has a deadline and budget
+ * left is kept in a heap by deadline, and all others are ordered by Levels.
+ */
+template <typename Levels>
+class deadline_queue
+{
+    private:
+        Thread **threads;
+        Levels by_level;
+        std::vector<int> heap;  // The earliest deadline on top.
+
+        bool by_deadline(int tid) const
+        {
+            return threads[tid]->has_deadline() && threads[tid]->get_deadline_budget() > 0;
+        }
+
+        struct later_deadline
+        {
+            Thread **threads;
+
+            bool operator()(int tid1, int tid2) const
+            {
+                return threads[tid1]->get_deadline() > threads[tid2]->get_deadline();
+            }
+        };
+
+    public:
+        static const int levels = Levels::levels;
+        static const bool deadlines = true;
+
+        explicit deadline_queue(Thread **threads) : threads(threads), by_level(threads) {}
+
+        void push(int tid)
+        {
+            if (!by_deadline(tid))
+            {
+                by_level.push(tid);
+                return;
+            }
+            heap.push_back(tid);
+            std::push_heap(heap.begin(), heap.end(), later_deadline{threads});
+        }
+
+        bool remove(int tid)
+        {
+            if (!by_deadline(tid))
+            {
+                return by_level.remove(tid);
+            }
+            std::vector<int>::iterator it = std::find(heap.begin(), heap.end(), tid);
+            if (it == heap.end())
+            {
+                return false;
+            }
+            heap.erase(it);
+            std::make_heap(heap.begin(), heap.end(), later_deadline{threads});
+            return true;
+        }
+
+        template <typename Pick>
+        int pop(Pick pick)
+        {
+            if (heap.empty())
+            {
+                return by_level.pop(pick);
+            }
+            std::pop_heap(heap.begin(), heap.end(), later_deadline{threads});
+            int tid = heap.back();
+            heap.pop_back();
+            return tid;
+        }
+
+        bool empty() const
+        {
+            return heap.empty() && by_level.empty();
+        }
+
+        void remove_if(const bool *marked)
+        {
+            heap.erase(std::remove_if(heap.begin(), heap.end(), [marked](int tid) { return marked[tid]; }),
+                       heap.end());
+            std::make_heap(heap.begin(), heap.end(), later_deadline{threads});
+            by_level.remove_if(marked);
+        }
+
+        template <typename F>
+        void for_each(F f) const
+        {
+            std::for_each(heap.begin(), heap.end(), f);
+            by_level.for_each(f);
+        }
+
+        void preempted(Thread *thread)
+        {
+            by_level.preempted(thread);
+        }
+
+        void suspended(Thread *thread)
+        {
+            by_level.suspended(thread);
+        }
+
+        void quantum_started(int total_quanta)
+        {
+            by_level.quantum_started(total_quanta);
+        }
+};
+
+
+/**
+ * Stacks of Size bytes from the heap.
+ */
+template <unsigned int Size>
+struct heap_stacks
+{
+    static const unsigned int size = Size;
+
+    static char *allocate(unsigned int extra)
+    {
+        return new char[Size + extra];
+    }
+
+    static void release(char *memory)
+    {
+        delete[] memory;
+    }
+};
+
+
+/**
+ * Measures quanta with the interval timer Which, which raises Signal. If Simulated, the scheduler
+ * can instead be switched to a simulated clock that only advances when told to, and the order of
+ * ready threads of a level can be shuffled by a seed.
+ */
+template <int Which, int Signal, bool Simulated>
+class interval_timer
+{
+    private:
+        bool simulated;     // Constant false unless Simulated, so every branch on it is dropped.
+        unsigned int sim_ticks;     // Simulated ticks elapsed in the current quantum.
+        long long sim_clock;    // Simulated ticks elapsed since the clock was started.
+        unsigned int sim_seed;  // State of the scheduling choice generator, 0 keeps round-robin order.
+
+        void set(long long usecs)
+        {
+            struct itimerval tv;
+            tv.it_value.tv_sec = usecs / SEC_TO_MICROSECS;
+            tv.it_value.tv_usec = usecs % SEC_TO_MICROSECS;
+            tv.it_interval = tv.it_value;
+            if (setitimer(Which, &tv, NULL) == FAIL_CODE)
+            {
+                std::cerr << SYS_ERROR_MSG << "failed to reset virtual timer.\n";
+                exit(1);
+            }
+        }
+
+    public:
+        static const int signal = Signal;
+
+        interval_timer() : simulated(false), sim_ticks(0), sim_clock(0), sim_seed(0) {}
+
+        /**
+         * Switches to the simulated clock, must be called before the scheduler is started.
+         */
+        void simulate(unsigned int seed)
+        {
+            simulated = Simulated;
+            sim_seed = seed;
+        }
+
+        bool is_simulated() const
+        {
+            return Simulated && simulated;
+        }
+
+        /**
+         * Starts a quantum of the given length, in microseconds or in simulated ticks.
+         */
+        void arm(long long quantum)
+        {
+            if (is_simulated())
+            {
+                sim_ticks = 0;
+                return;
+            }
+            set(quantum);
+        }
+
+        /**
+         * Raises the signal again after usecs microseconds, from a signal handler.
+         */
+        void arm_margin(int usecs)
+        {
+            struct itimerval margin;
+            margin.it_value.tv_sec = usecs / SEC_TO_MICROSECS;
+            margin.it_value.tv_usec = usecs % SEC_TO_MICROSECS;
+            margin.it_interval = margin.it_value;
+            setitimer(Which, &margin, NULL);
+        }
+
+        /**
+         * Returns the current time, in microseconds of real time, or in ticks of the simulated clock.
+         */
+        long long now() const
+        {
+            if (is_simulated())
+            {
+                return sim_clock;
+            }
+            struct timespec now;
+            if (clock_gettime(CLOCK_MONOTONIC, &now) == FAIL_CODE)
+            {
+                std::cerr << SYS_ERROR_MSG << "failed to read the monotonic clock.\n";
+                exit(1);
+            }
+            return (long long)now.tv_sec * SEC_TO_MICROSECS + now.tv_nsec / 1000;
+        }
+
+        /**
+         * Advances the simulated clock, and returns whether the current quantum is over.
+         */
+        bool advance(unsigned int ticks, long long quantum)
+        {
+            if (!is_simulated())
+            {
+                return false;
+            }
+            sim_ticks += ticks;
+            sim_clock += ticks;
+            return sim_ticks >= quantum;
+        }
+
+        /**
+         * Returns the position in a ready queue of the next thread to run. This is the front of
+         * the queue, unless the simulated clock was given a seed.
+         */
+        unsigned int next_position(unsigned int queue_size)
+        {
+            if (!is_simulated() || sim_seed == 0)
+            {
+                return 0;
+            }
+            // Xorshift step, never reaches 0 from a non-zero state.
+            sim_seed ^= sim_seed << 13;
+            sim_seed ^= sim_seed >> 17;
+            sim_seed ^= sim_seed << 5;
+            return sim_seed % queue_size;
+        }
+};
+
+
+/**
+ * Ignores the quanta.
+ */
+struct no_stats
+{
+    static void quantum_started(int, int) {}
+};
+
+
+/**
+ * The thread table, the ready threads and the switching between them. There is a single active
+ * scheduler per process, since the timer signal has a single handler.
+ */
+template <typename QueuePolicy, typename StackProvider, typename TimerBackend, typename StatsSink>
+class scheduler
+{
+    private:
+        static scheduler *active;   // The scheduler the timer signal handler preempts for.
+        sigset_t signal_set;    // Signal set used for signal masking.
+        Thread *released_running_thread;    // The last running thread that was deleted, not freed yet.
+
+        static void handle_timer(int)
+        {
+            active->timer_expired();
+        }
+
+    public:
+        typedef QueuePolicy queue_type;
+
+        Thread *threads[MAX_THREAD_NUM];
+        int running_tid;    // The ID of the currently running thread.
+        Thread *current_thread;     // Cached threads[running_tid], so thread-local lookups skip the array.
+        int total_quanta;   // Quantum counter for all threads in total.
+        QueuePolicy ready;
+        TimerBackend timer;
+        int quantum_length;     // The number of microseconds (or simulated ticks) in each quantum by default.
+        bool adaptive_quantum;  // Whether quanta are scaled by how each thread used its recent quanta.
+        bool cooperative;   // Whether timer expiration only requests a switch at the next safepoint.
+        int preemption_margin;  // Microseconds a thread may overrun its quantum in cooperative mode.
+        volatile sig_atomic_t preempt_pending;  // Whether the quantum is over and the next safepoint switches.
+        void (*on_switch)(bool from_signal);    // Called before every scheduling decision, if set.
+        void (*on_idle)();  // Waits for work when no thread is ready. If not set, the process exits.
+
+        scheduler() : released_running_thread(nullptr), threads(), running_tid(0), current_thread(nullptr),
+                      total_quanta(1), ready(threads), quantum_length(0), adaptive_quantum(false),
+                      cooperative(false), preemption_margin(0), preempt_pending(0), on_switch(nullptr),
+                      on_idle(nullptr) {}
+
+        /**
+         * Initiates the main thread, the timer signal handler and the signal set used for masking,
+         * and starts the first quantum.
+         */
+        void start(int quantum)
+        {
+            active = this;
+            quantum_length = quantum;
+            // Every other thread in the threads array is initiated to nullptr.
+            threads[0] = new Thread(0, StackProvider::allocate(ARENA_SIZE), StackProvider::size);
+            threads[0]->setState(RUNNING);
+            running_tid = 0;
+            current_thread = threads[0];
+
+            struct sigaction sa = {};
+            sa.sa_handler = &handle_timer;
+            if (sigaction(TimerBackend::signal, &sa, NULL) < 0)
+            {
+                std::cerr << SYS_ERROR_MSG << "failed to set signal action handler.\n";
+                exit(1);
+            }
+            if (sigemptyset(&signal_set) == FAIL_CODE)
+            {
+                std::cerr << SYS_ERROR_MSG << "failed to empty signal set.\n";
+                exit(1);
+            }
+            if (sigaddset(&signal_set, TimerBackend::signal) == FAIL_CODE)
+            {
+                std::cerr << SYS_ERROR_MSG << "failed to add signal to signal set.\n";
+                exit(1);
+            }
+#ifdef DEBUG
+            std::cout << "initiating timer with " << quantum << " microsecs\n";
+#endif
+            arm_timer();
+            unblock_timer();
+        }
+
+        /**
+         * Checks if given thread exists and is in the valid range.
+         */
+        bool is_tid_valid(int tid) const
+        {
+            if (tid < 0 || tid >= MAX_THREAD_NUM)
+            {
+                std::cerr << LIB_ERROR_MSG << "invalid thread ID provided.\n";
+                return false;
+            }
+            else if (threads[tid] == nullptr)
+            {
+                std::cerr << LIB_ERROR_MSG << "could not find thread with the given ID.\n";
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * Blocks alarm signals.
+         */
+        void block_timer()
+        {
+#ifdef DEBUG
+            std::cout << "blocking timer\n";
+#endif
+            if (sigprocmask(SIG_BLOCK, &signal_set, NULL) == FAIL_CODE)
+            {
+                std::cerr << SYS_ERROR_MSG << "failed to block signal set.\n";
+                exit(1);
+            }
+        }
+
+        /**
+         * Stops the blocking of alarm signals.
+         */
+        void unblock_timer()
+        {
+#ifdef DEBUG
+            std::cout << "unblocking timer\n";
+#endif
+            if (sigprocmask(SIG_UNBLOCK, &signal_set, NULL) == FAIL_CODE)
+            {
+                std::cerr << SYS_ERROR_MSG << "failed to unblock signal set.\n";
+                exit(1);
+            }
+        }
+
+        /**
+         * Returns the current time of the library clock.
+         */
+        long long time() const
+        {
+            return timer.now();
+        }
+
+        /**
+         * Returns the quantum length of the running thread, in microseconds or in simulated ticks.
+         */
+        long long running_quantum() const
+        {
+            long long quantum = current_thread->get_quantum() == DEFAULT_QUANTUM ? quantum_length
+                                                                                 : current_thread->get_quantum();
+            if (adaptive_quantum)
+            {
+                int scale = current_thread->get_quantum_scale();
+                quantum = scale >= 0 ? quantum << scale : quantum >> -scale;
+            }
+            return std::max(quantum, 1LL);
+        }
+
+        /**
+         * Resets the timer to the quantum of the running thread, without unblocking the signals.
+         */
+        void arm_timer()
+        {
+#ifdef DEBUG
+            std::cout << "resetting timer\n";
+#endif
+            preempt_pending = 0;
+            timer.arm(running_quantum());
+        }
+
+        /**
+         * Adds a thread to the ready threads.
+         */
+        void push_ready(int tid)
+        {
+            ready.push(tid);
+        }
+
+        /**
+         * Tries to remove a thread from the ready threads.
+         * @return 0 upon success, -1 upon failure.
+         */
+        int remove_ready(int tid)
+        {
+            return ready.remove(tid) ? SUCCESS_CODE : FAIL_CODE;
+        }
+
+        /**
+         * Creates the thread with the given ID, which starts running at the function start. The
+         * thread is not added to the ready threads.
+         */
+        Thread *create_thread(int tid, void (*start)(void))
+        {
+            threads[tid] = new Thread(tid, start, StackProvider::allocate(ARENA_SIZE), StackProvider::size);
+            return threads[tid];
+        }
+
+        /**
+         * Deletes a thread and frees its ID. The running thread keeps using its stack until it
+         * switches, so it is freed only when another running thread is deleted.
+         */
+        void delete_thread(int tid)
+        {
+            if (tid == running_tid)
+            {
+                free_thread(released_running_thread);
+                released_running_thread = threads[tid];
+            }
+            else
+            {
+                free_thread(threads[tid]);
+            }
+            threads[tid] = nullptr;
+        }
+
+        /**
+         * Deletes every thread, before the process exits.
+         */
+        void delete_all()
+        {
+            for (int i=0; i<MAX_THREAD_NUM; i++)
+            {
+                free_thread(threads[i]);
+                threads[i] = nullptr;
+            }
+            free_thread(released_running_thread);
+            released_running_thread = nullptr;
+        }
+
+        /**
+         * Ends the current job of a thread with a deadline, and counts a miss if the deadline
+         * passed. The thread must not be among the ready threads.
+         */
+        void end_deadline_job(Thread *thread)
+        {
+            if (!QueuePolicy::deadlines || !thread->has_deadline())
+            {
+                return;
+            }
+            if (time() > thread->get_deadline())
+            {
+                thread->inc_deadline_misses();
+            }
+            thread->set_deadline(NO_DEADLINE);
+        }
+
+        /**
+         * Signals the next ready thread to run. This function is not responsible to save the env
+         * or modify the data for the currently running thread.
+         * @param from_signal - whether the scheduler runs in the timer signal handler.
+         */
+        void switch_thread(bool from_signal)
+        {
+#ifdef DEBUG
+            std::cout << "switching threads\n";
+#endif
+            if (on_switch != nullptr)
+            {
+                on_switch(from_signal);
+            }
+            ready.quantum_started(total_quanta);
+            // The running thread is among the ready threads if it may keep running, so when there
+            // are none no thread can run until on_idle brings one.
+            while (ready.empty())
+            {
+                if (on_idle == nullptr)
+                {
+                    std::cerr << LIB_ERROR_MSG << "all threads are blocked.\n";
+                    exit(1);
+                }
+                on_idle();
+                if (on_switch != nullptr)
+                {
+                    on_switch(from_signal);
+                }
+            }
+            running_tid = ready.pop([this](unsigned int size) { return timer.next_position(size); });
+            current_thread = threads[running_tid];
+            current_thread->setState(RUNNING);
+            current_thread->inc_quantum_count();
+            total_quanta++;
+            StatsSink::quantum_started(running_tid, total_quanta);
+            // The signals stay blocked until siglongjmp restores the mask of the next thread. A
+            // timer that expired meanwhile, e.g. a real-time timer while idle, would otherwise save
+            // this stack as the env of the next thread.
+            arm_timer();
+            siglongjmp(*(current_thread->getEnv()), ENV_LOAD_CODE);
+        }
+
+        /**
+         * Moves the running thread, whose quantum is over, to the ready threads and switches to
+         * the next thread.
+         * @param from_signal - whether the thread is preempted from the timer signal handler.
+         */
+        void preempt_running_thread(bool from_signal)
+        {
+            Thread *self = current_thread;
+            // A thread that used its whole quantum gets a longer adaptive quantum.
+            ready.preempted(self);
+            self->set_quantum_scale(std::min(self->get_quantum_scale() + 1, MAX_QUANTUM_SCALE));
+            if (QueuePolicy::deadlines && self->has_deadline())
+            {
+                // A thread still running past its deadline missed it, and does not keep running
+                // ahead of others.
+                if (time() > self->get_deadline())
+                {
+                    end_deadline_job(self);
+                }
+                // A job that used up its budget keeps its deadline, but is ordered by its level
+                // until it ends, so it cannot starve the threads without one.
+                else
+                {
+                    self->set_deadline_budget(std::max(self->get_deadline_budget() - 1, 0));
+                }
+            }
+            self->setState(READY);
+            push_ready(running_tid);
+            // The kernel saves the extended state of a thread interrupted by a signal, and
+            // restores it when the handler returns.
+            if (!from_signal)
+            {
+                self->save_extended_state();
+            }
+            int ret_val = sigsetjmp(*(self->getEnv()), 1);
+            // If thread state env was just saved.
+            if (ret_val == ENV_SAVE_CODE)
+            {
+                switch_thread(from_signal);
+            }
+            else if (!from_signal)
+            {
+                self->restore_extended_state();
+            }
+        }
+
+        /**
+         * Saves the env of the running thread, which blocked itself, and switches to the next
+         * thread. A thread that blocks before its quantum is over gets a shorter adaptive quantum.
+         */
+        void suspend_running_thread()
+        {
+            Thread *self = current_thread;
+            ready.suspended(self);
+            self->set_quantum_scale(std::max(self->get_quantum_scale() - 1, -MAX_QUANTUM_SCALE));
+            // Blocking ends the job of a thread with a deadline.
+            end_deadline_job(self);
+            self->save_extended_state();
+            int ret_val = sigsetjmp(*(self->getEnv()), 1);
+            // If the thread env was just saved.
+            if (ret_val == ENV_SAVE_CODE)
+            {
+                switch_thread(false);
+            }
+            self->restore_extended_state();
+        }
+
+        /**
+         * Handles timer expiration. In cooperative mode, the first expiration only requests a
+         * switch at the next safepoint, and the thread is preempted if it overruns the margin.
+         */
+        void timer_expired()
+        {
+#ifdef DEBUG
+            std::cout << "handling alarm signal\n";
+#endif
+            if (cooperative && !preempt_pending)
+            {
+                preempt_pending = 1;
+                timer.arm_margin(preemption_margin);
+                return;
+            }
+            preempt_running_thread(true);
+        }
+
+        /**
+         * Advances the simulated clock, and preempts the running thread if its quantum is over.
+         * Does nothing when the simulated clock is not in use.
+         */
+        void advance_clock(unsigned int ticks)
+        {
+            if (timer.advance(ticks, running_quantum()))
+            {
+                block_timer();
+                preempt_running_thread(false);
+                unblock_timer();
+            }
+        }
+
+        /**
+         * Advances the simulated clock by ticks, and switches threads if the quantum of the
+         * running thread ended while in cooperative mode.
+         */
+        void safepoint(unsigned int ticks)
+        {
+            advance_clock(ticks);
+            if (preempt_pending)
+            {
+                block_timer();
+                // The timer may have preempted the thread before it was blocked.
+                if (preempt_pending)
+                {
+                    preempt_running_thread(false);
+                }
+                unblock_timer();
+            }
+        }
+
+    private:
+        static void free_thread(Thread *thread)
+        {
+            if (thread != nullptr)
+            {
+                char *memory = thread->getStack();
+                delete thread;
+                StackProvider::release(memory);
+            }
+        }
+};
+
+template <typename QueuePolicy, typename StackProvider, typename TimerBackend, typename StatsSink>
+scheduler<QueuePolicy, StackProvider, TimerBackend, StatsSink> *
+scheduler<QueuePolicy, StackProvider, TimerBackend, StatsSink>::active = nullptr;
+
+#endif //OS_EX2_SCHEDULER_H
@@ -2,9 +2,17 @@
 // Created by Tomer Greenberg on 4/9/19.
 //
 #include "uthreads.h"
+#include "utask_group.h"
 #include <stdlib.h>
 #include <unistd.h>
 #include <iostream>
+#include <fenv.h>
+#include <pthread.h>
+#include <signal.h>
+#include <chrono>
+#if __cplusplus >= 202002L
+#include "utask.h"
+#endif
 
 
 void f1()
@@ -78,6 +86,640 @@ int test_basic_timer_use()
 }
 
 
+void f_ticking()
+{
+    while (true)
+    {
+        std::cout << uthread_get_tid();
+        uthread_tick(1);
+    }
+}
+
+
+int test_simulated_clock()
+{
+    // Running this twice with the same seed should print the same interleaving.
+    uthread_init_simulated(4, 42);
+    uthread_spawn(f_ticking);
+    uthread_spawn(f_ticking);
+    uthread_spawn(f_ticking);
+    while (uthread_get_total_quantums() < 50)
+    {
+        uthread_tick(1);
+    }
+    std::cout << '\n';
+    uthread_terminate(0);
+    return 0;
+}
+
+
+int counter_key;
+int overflow_key;
+
+void f_local_counter()
+{
+    int counter = 0;
+    long overflow_counter = 0;
+    uthread_setspecific(counter_key, &counter);
+    uthread_setspecific(overflow_key, &overflow_counter);
+    while (true)
+    {
+        (*(int*)uthread_getspecific(counter_key))++;
+        (*(long*)uthread_getspecific(overflow_key))++;
+        if (counter % 1000000 == 0)
+        {
+            // Both counters are private to this thread, so they never drift apart.
+            std::cout << uthread_get_tid() << ": " << counter << " " << overflow_counter << '\n';
+        }
+    }
+}
+
+
+int test_thread_local()
+{
+    uthread_init(3000);
+    uthread_key_create(&counter_key);
+    // Creates enough keys to get past the inline slots.
+    for (int i=0; i<10; i++)
+    {
+        uthread_key_create(&overflow_key);
+    }
+    uthread_spawn(f_local_counter);
+    uthread_spawn(f_local_counter);
+    print(uthread_getspecific(counter_key) == nullptr);
+    while (uthread_get_total_quantums() < 100) {}
+    uthread_terminate(0);
+    return 0;
+}
+
+
+int results[MAX_THREAD_NUM];
+
+void f_exit_with_tid()
+{
+    int tid = uthread_get_tid();
+    results[tid] = tid * 10;
+    uthread_exit(&results[tid]);
+}
+
+
+void f_block_then_exit()
+{
+    uthread_block(uthread_get_tid());
+    f_exit_with_tid();
+}
+
+
+void f_return()
+{
+    results[uthread_get_tid()] = 1;
+}
+
+
+void f_join_previous()
+{
+    // Joins the thread spawned right before this one.
+    void *value;
+    print(uthread_join(uthread_get_tid() - 1, &value));
+    print(*(int*)value);
+    uthread_exit(nullptr);
+}
+
+
+int test_join_and_exit()
+{
+    uthread_init(3000);
+    void *value;
+    int tid = uthread_spawn(f_exit_with_tid);
+    print(uthread_join(tid, &value));
+    print(*(int*)value);
+    // The ID was released by the join, so it is reused.
+    print(uthread_spawn(f_exit_with_tid));
+    uthread_spawn(f_join_previous);
+    print(uthread_join(2, nullptr));
+    tid = uthread_spawn(f_exit_with_tid);
+    print(uthread_detach(tid));
+    print(uthread_join(tid, nullptr));
+    // A joiner blocked by uthread_block stays blocked after the joined thread exits.
+    int target = uthread_spawn(f_block_then_exit);
+    int joiner = uthread_spawn(f_join_previous);
+    results[target] = 0;
+    while (uthread_get_quantums(joiner) == 0) {}
+    uthread_block(joiner);
+    uthread_resume(target);
+    while (((volatile int*)results)[target] == 0) {}
+    print_thread_status();
+    uthread_resume(joiner);
+    print(uthread_join(joiner, nullptr));
+    // A thread that returned keeps its ID until it is joined.
+    int quick = uthread_spawn(f_return);
+    results[quick] = 0;
+    while (((volatile int*)results)[quick] == 0) {}
+    print(uthread_spawn(f_exit_with_tid) != quick);
+    print(uthread_join(quick, nullptr));
+    uthread_terminate(0);
+    return 0;
+}
+
+
+int test_batched_block_and_resume()
+{
+    uthread_init(3000);
+    void (*fs[])(void) = {f1, f1, f1, f1};
+    int tids[4];
+    print(uthread_spawn_n(fs, 4, tids));
+    print_thread_status();
+    print(uthread_block_many(tids, 3));
+    print_thread_status();
+    // Fails as a whole since the main thread cannot be blocked.
+    int with_main[] = {tids[3], 0};
+    print(uthread_block_many(with_main, 2));
+    print_thread_status();
+    int reversed[] = {tids[2], tids[1], tids[0]};
+    print(uthread_resume_many(reversed, 3));
+    print(uthread_resume_many(reversed, -1));
+    print_thread_status();
+    uthread_terminate(0);
+    return 0;
+}
+
+
+void f_interactive()
+{
+    while (true)
+    {
+        // Blocks itself every time it runs, so it stays at the highest level.
+        std::cout << "interactive ran at quantum " << uthread_get_total_quantums() << '\n';
+        uthread_block(uthread_get_tid());
+    }
+}
+
+
+void f_batch()
+{
+    int tid = uthread_get_tid();
+    int last_quantum = 0;
+    while (true)
+    {
+        // Prints once each time the thread gets a new quantum.
+        if (uthread_get_quantums(tid) != last_quantum)
+        {
+            last_quantum = uthread_get_quantums(tid);
+            std::cout << "batch " << tid << " ran at quantum " << uthread_get_total_quantums() << '\n';
+        }
+    }
+}
+
+
+int test_priorities()
+{
+    uthread_init(3000);
+    int interactive = uthread_spawn(f_interactive);
+    uthread_set_priority(uthread_spawn(f_batch), PRIORITY_LEVELS - 1);
+    uthread_set_priority(uthread_spawn(f_batch), PRIORITY_LEVELS - 1);
+    print_thread_status();
+    while (uthread_get_total_quantums() < 200)
+    {
+        // Wakes the interactive thread, which should run ahead of the batch threads.
+        uthread_resume(interactive);
+    }
+    uthread_terminate(0);
+    return 0;
+}
+
+
+void f_deadline_job()
+{
+    int tid = uthread_get_tid();
+    while (true)
+    {
+        // Each job takes tid*5 ticks, so only short jobs meet their deadline.
+        uthread_set_deadline(tid, 12, 4);
+        for (int i=0; i<tid*5; i++)
+        {
+            uthread_tick(1);
+        }
+        std::cout << "thread " << tid << " finished a job, missed " << uthread_get_deadline_misses(tid) << '\n';
+        uthread_block(tid);
+    }
+}
+
+
+int test_deadlines()
+{
+    uthread_init_simulated(4, 0);
+    int background = uthread_spawn(f_ticking);
+    int short_jobs = uthread_spawn(f_deadline_job);
+    int long_jobs = uthread_spawn(f_deadline_job);
+    while (uthread_get_total_quantums() < 100)
+    {
+        uthread_resume(short_jobs);
+        uthread_resume(long_jobs);
+        uthread_tick(1);
+    }
+    std::cout << '\n';
+    print(uthread_get_deadline_misses(background));
+    print(uthread_get_deadline_misses(short_jobs));
+    print(uthread_get_deadline_misses(long_jobs));
+    uthread_terminate(0);
+    return 0;
+}
+
+
+void f_long_job()
+{
+    uthread_set_deadline(uthread_get_tid(), 200, 2);
+    while (true)
+    {
+        uthread_tick(1);
+    }
+}
+
+
+void f_late_exit()
+{
+    uthread_set_deadline(uthread_get_tid(), 1, 1);
+    uthread_tick(2);
+    uthread_exit(nullptr);
+}
+
+
+int test_deadline_budget()
+{
+    uthread_init_simulated(4, 0);
+    // The long job runs ahead of the main thread for 2 quanta only, then they take turns.
+    uthread_spawn(f_long_job);
+    while (uthread_get_quantums(0) < 5)
+    {
+        uthread_tick(1);
+    }
+    print(uthread_get_total_quantums());
+    // Exiting after the deadline counts as a miss.
+    int late = uthread_spawn(f_late_exit);
+    for (int i=0; i<20; i++)
+    {
+        uthread_tick(1);
+    }
+    print(uthread_get_deadline_misses(late));
+    uthread_terminate(0);
+    return 0;
+}
+
+
+int test_quantum_lengths()
+{
+    uthread_init_simulated(2, 0);
+    uthread_spawn(f_ticking);
+    uthread_set_quantum(uthread_spawn(f_ticking), 8);
+    while (uthread_get_total_quantums() < 20)
+    {
+        uthread_tick(1);
+    }
+    std::cout << '\n';
+    // Compute-bound threads get longer and longer quanta, up to 4 times their length.
+    uthread_set_adaptive_quantum(1);
+    while (uthread_get_total_quantums() < 40)
+    {
+        uthread_tick(1);
+    }
+    std::cout << '\n';
+    uthread_terminate(0);
+    return 0;
+}
+
+
+void f_cooperative()
+{
+    int tid = uthread_get_tid();
+    int last_quantum = 0;
+    for (int i=0; ; i++)
+    {
+        // Only switched at the safepoint, so a quantum always ends at a multiple of 1000.
+        if (i % 1000 == 0)
+        {
+            uthread_safepoint();
+            if (uthread_get_quantums(tid) != last_quantum)
+            {
+                last_quantum = uthread_get_quantums(tid);
+                std::cout << tid << " resumed at iteration " << i << '\n';
+            }
+        }
+    }
+}
+
+
+int test_cooperative()
+{
+    uthread_init(3000);
+    uthread_set_cooperative(1, 1000);
+    uthread_spawn(f_cooperative);
+    uthread_spawn(f_cooperative);
+    // Every library call is a safepoint too.
+    while (uthread_get_total_quantums() < 20) {}
+    uthread_terminate(0);
+    return 0;
+}
+
+
+void f_allocate()
+{
+    int tid = uthread_get_tid();
+    // Allocates more than the arena holds, so it has to grow.
+    for (int round=0; round<3; round++)
+    {
+        char *blocks[20];
+        for (int i=0; i<20; i++)
+        {
+            blocks[i] = (char*)uthread_alloc(1000);
+            blocks[i][0] = tid;
+        }
+        for (int i=0; i<20; i++)
+        {
+            uthread_free(blocks[i]);
+        }
+    }
+    // A freed block is reused by the next allocation of its size class.
+    void *block = uthread_alloc(20);
+    uthread_free(block);
+    print(uthread_alloc(32) == block);
+    print(uthread_alloc(UTHREAD_MAX_ALLOC + 1) == nullptr);
+    uthread_exit(nullptr);
+}
+
+
+int test_arena()
+{
+    uthread_init(3000);
+    int tid1 = uthread_spawn(f_allocate);
+    int tid2 = uthread_spawn(f_allocate);
+    uthread_join(tid1, nullptr);
+    uthread_join(tid2, nullptr);
+    uthread_terminate(0);
+    return 0;
+}
+
+
+void f_rounding()
+{
+    // Each thread uses its own SSE rounding mode, which must survive switches.
+    int mode = uthread_get_tid() % 2 == 0 ? FE_UPWARD : FE_DOWNWARD;
+    fesetround(mode);
+    volatile double third = 1.0;
+    for (int i=0; i<1000; i++)
+    {
+        third = third / 3.0 * 3.0;
+        uthread_tick(1);
+        if (fegetround() != mode)
+        {
+            std::cout << "thread " << uthread_get_tid() << " lost its rounding mode\n";
+        }
+    }
+    uthread_exit(nullptr);
+}
+
+
+int test_extended_state()
+{
+    uthread_init_simulated(3, 0);
+    int tid1 = uthread_spawn(f_rounding);
+    int tid2 = uthread_spawn(f_rounding);
+    uthread_join(tid1, nullptr);
+    uthread_join(tid2, nullptr);
+    std::cout << "done\n";
+    uthread_terminate(0);
+    return 0;
+}
+
+
+int inbox_worker;
+
+void f_inbox_worker()
+{
+    for (int i=0; i<5; i++)
+    {
+        // Nothing else is READY, so the library waits for the pthread to resume this thread.
+        uthread_block(uthread_get_tid());
+        std::cout << "resumed by the pthread " << i << '\n';
+    }
+    uthread_exit(nullptr);
+}
+
+
+void f_posted()
+{
+    std::cout << "spawned by the pthread\n";
+    uthread_exit(nullptr);
+}
+
+
+void *post_requests(void *)
+{
+    uthread_post_spawn(f_posted);
+    for (int i=0; i<5; i++)
+    {
+        usleep(10000);
+        uthread_post_resume(inbox_worker);
+    }
+    return nullptr;
+}
+
+
+int test_inbox()
+{
+    uthread_init(3000);
+    inbox_worker = uthread_spawn(f_inbox_worker);
+    // The pthread inherits the blocked timer signal, so it is never interrupted by the scheduler.
+    sigset_t timer_set;
+    sigemptyset(&timer_set);
+    sigaddset(&timer_set, UTHREAD_TIMER_SIGNAL);
+    sigprocmask(SIG_BLOCK, &timer_set, NULL);
+    pthread_t poster;
+    pthread_create(&poster, NULL, post_requests, NULL);
+    sigprocmask(SIG_UNBLOCK, &timer_set, NULL);
+    uthread_join(inbox_worker, nullptr);
+    pthread_join(poster, NULL);
+    uthread_terminate(0);
+    return 0;
+}
+
+
+void f_add_one(void *arg)
+{
+    // Returns without calling uthread_exit.
+    *(int*)arg += 1;
+}
+
+
+int test_spawn_closures()
+{
+    uthread_init(3000);
+    int counter = 0;
+    int tid1 = uthread_spawn_arg(f_add_one, &counter);
+    int base = 10;
+    int tid2 = uthread_spawn([base, &counter]() { counter += base; });
+    // Too large to be kept inside the thread, so it is moved to the heap.
+    int weights[32] = {100};
+    int tid3 = uthread_spawn([weights, &counter]() { counter += weights[0]; });
+    uthread_join(tid1, nullptr);
+    uthread_join(tid2, nullptr);
+    uthread_join(tid3, nullptr);
+    std::cout << "counter " << counter << '\n';
+    uthread_terminate(0);
+    return 0;
+}
+
+
+#define BENCHMARK_ITEMS 20000
+#define BENCHMARK_BATCH 50
+
+long long squares[BENCHMARK_ITEMS];
+
+long long elapsed_usecs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+long long sum_squares()
+{
+    long long sum = 0;
+    for (int i=0; i<BENCHMARK_ITEMS; i++)
+    {
+        sum += squares[i];
+        squares[i] = 0;
+    }
+    return sum;
+}
+
+
+int test_task_group()
+{
+    uthread_init(3000);
+    // Spawns a thread per item, at most BENCHMARK_BATCH at a time.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int first=0; first<BENCHMARK_ITEMS; first+=BENCHMARK_BATCH)
+    {
+        int tids[BENCHMARK_BATCH];
+        for (int i=0; i<BENCHMARK_BATCH; i++)
+        {
+            int item = first + i;
+            tids[i] = uthread_spawn([item]() { squares[item] = (long long)item * item; });
+        }
+        for (int i=0; i<BENCHMARK_BATCH; i++)
+        {
+            uthread_join(tids[i], nullptr);
+        }
+    }
+    long long naive = elapsed_usecs(start);
+    std::cout << "spawn per item: " << sum_squares() << " in " << naive << " usecs\n";
+    int grains[] = {1, 64};
+    for (int grain : grains)
+    {
+        start = std::chrono::steady_clock::now();
+        {
+            uthread_task_group group(4);
+            group.parallel_for(0, BENCHMARK_ITEMS, grain, [](int i) { squares[i] = (long long)i * i; });
+        }
+        long long grouped = elapsed_usecs(start);
+        std::cout << "task group, grain " << grain << ": " << sum_squares() << " in " << grouped << " usecs\n";
+    }
+    uthread_terminate(0);
+    return 0;
+}
+
+
+#ifdef UTHREAD_STATS_SINK
+int started_quanta[MAX_THREAD_NUM];
+
+void UTHREAD_STATS_SINK(int tid, int)
+{
+    started_quanta[tid]++;
+}
+
+
+int test_stats_sink()
+{
+    uthread_init(3000);
+    int tid = uthread_spawn(f_exit_with_tid);
+    uthread_join(tid, nullptr);
+    std::cout << "thread " << tid << " started " << started_quanta[tid] << " quanta\n";
+    uthread_terminate(0);
+    return 0;
+}
+#endif
+
+
+#if __cplusplus >= 202002L
+uthread::task<int> square(int x)
+{
+    co_await uthread::yield();
+    co_return x * x;
+}
+
+
+uthread::task<void> print_squares(int tid)
+{
+    for (int i=0; i<3; i++)
+    {
+        std::cout << "task " << tid << ": " << co_await square(i) << '\n';
+    }
+    void *value;
+    // Other tasks keep running while this one waits for the thread.
+    print(co_await uthread::join(tid, &value));
+    std::cout << "task " << tid << " joined " << *(int*)value << '\n';
+}
+
+
+void f_spin_and_exit()
+{
+    // The first thread spawned spins the longest, so it exits last.
+    volatile int spin = 0;
+    for (int i=0; i<(4 - uthread_get_tid()) * 20000000; i++)
+    {
+        spin = i;
+    }
+    (void)spin;
+    f_exit_with_tid();
+}
+
+
+void f_resume_main()
+{
+    uthread_resume(0);
+}
+
+
+uthread::task<void> print_bad_join()
+{
+    // Fails right away, while the other tasks keep waiting for their threads.
+    print(co_await uthread::join(MAX_THREAD_NUM - 1));
+    std::cout << "bad join done\n";
+}
+
+
+uthread::task<void> print_when_resumed()
+{
+    co_await uthread::resumed();
+    std::cout << "task resumed\n";
+}
+
+
+int test_tasks()
+{
+    uthread_init(3000);
+    uthread::task_queue tasks;
+    tasks.spawn(print_squares(uthread_spawn(f_spin_and_exit)));
+    tasks.spawn(print_squares(uthread_spawn(f_spin_and_exit)));
+    tasks.spawn(print_bad_join());
+    tasks.spawn(print_when_resumed());
+    uthread_spawn(f_resume_main);
+    tasks.run();
+    uthread_terminate(0);
+    return 0;
+}
+#endif
+
+
 int main()
 {
     test_basic_timer_use();
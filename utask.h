@@ -0,0 +1,490 @@
+#ifndef OS_EX2_UTASK_H
+#define OS_EX2_UTASK_H
+
+#if __cplusplus < 202002L
+#error "utask.h requires C++20 coroutines (-std=c++20)"
+#endif
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <optional>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include "uthreads.h"
+#include "general.h"
+
+// Stackless tasks, run by uthreads. A task is a C++20 coroutine whose frame holds only its own
+// locals, and it runs on the stack of the uthread that runs its task_queue. A task can await other
+// tasks, give the worker to other tasks with yield(), wait for a uthread to exit with join(), and
+// wait for the worker to be resumed with resumed().
+
+namespace uthread
+{
+    class task_queue;
+
+    namespace detail
+    {
+        /**
+         * State shared by the promises of all tasks.
+         */
+        struct promise_base
+        {
+            task_queue *queue = nullptr;    // The queue running the task, inherited from its awaiter.
+            std::coroutine_handle<> continuation;   // The task awaiting this one, if any.
+            std::exception_ptr exception;
+
+            /**
+             * Resumes the awaiting task when the task is done. A root task is handed back to its
+             * queue, which destroys it right away.
+             */
+            struct final_awaiter
+            {
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+                {
+                    std::coroutine_handle<> continuation = handle.promise().continuation;
+                    if (!continuation && handle.promise().queue != nullptr)
+                    {
+                        // The frame is gone after this, so nothing may touch the promise.
+                        handle.promise().queue->finish(handle, handle.promise().exception);
+                        return std::noop_coroutine();
+                    }
+                    return continuation ? continuation : std::noop_coroutine();
+                }
+
+                void await_resume() noexcept {}
+            };
+
+            // Tasks are lazy, they start when awaited or spawned.
+            std::suspend_always initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            final_awaiter final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void unhandled_exception()
+            {
+                exception = std::current_exception();
+            }
+        };
+
+        /**
+         * Storage for the result of a task.
+         */
+        template <typename T>
+        struct promise_result : promise_base
+        {
+            std::optional<T> value;
+
+            void return_value(T result)
+            {
+                value = std::move(result);
+            }
+
+            T take()
+            {
+                return std::move(*value);
+            }
+        };
+
+        template <>
+        struct promise_result<void> : promise_base
+        {
+            void return_void() {}
+
+            void take() {}
+        };
+    }
+
+
+    /**
+     * A lazily started coroutine producing a T. Owns its coroutine frame.
+     */
+    template <typename T = void>
+    class task
+    {
+        public:
+            struct promise_type : detail::promise_result<T>
+            {
+                task get_return_object()
+                {
+                    return task(std::coroutine_handle<promise_type>::from_promise(*this));
+                }
+            };
+
+            task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+
+            task(const task &) = delete;
+
+            task &operator=(const task &) = delete;
+
+            ~task()
+            {
+                if (handle)
+                {
+                    handle.destroy();
+                }
+            }
+
+            /**
+             * Checks if the task ran to completion.
+             */
+            bool done() const
+            {
+                return handle.done();
+            }
+
+            /**
+             * Starts the task on the queue of the awaiting task, and resumes the awaiting task
+             * with its result when it is done.
+             */
+            struct awaiter
+            {
+                std::coroutine_handle<promise_type> handle;
+
+                bool await_ready() noexcept
+                {
+                    return false;
+                }
+
+                template <typename Promise>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
+                {
+                    handle.promise().queue = awaiting.promise().queue;
+                    handle.promise().continuation = awaiting;
+                    return handle;
+                }
+
+                T await_resume()
+                {
+                    if (handle.promise().exception)
+                    {
+                        std::rethrow_exception(handle.promise().exception);
+                    }
+                    return handle.promise().take();
+                }
+            };
+
+            awaiter operator co_await() noexcept
+            {
+                return awaiter{handle};
+            }
+
+        private:
+            friend class task_queue;
+
+            explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+            std::coroutine_handle<promise_type> handle;
+    };
+
+
+    /**
+     * Runs tasks on the stack of the uthread that calls run(). A queue must only be used by
+     * that uthread, so it needs no masking of the timer.
+     */
+    class task_queue
+    {
+        public:
+            task_queue() = default;
+
+            task_queue(const task_queue &) = delete;
+
+            task_queue &operator=(const task_queue &) = delete;
+
+            /**
+             * Destroys the tasks that never ran to completion.
+             */
+            ~task_queue()
+            {
+                destroy_roots();
+            }
+
+            /**
+             * Adds a task to the end of the queue. The queue keeps its frame until it is done.
+             */
+            void spawn(task<void> root)
+            {
+                root.handle.promise().queue = this;
+                ready.push_back(root.handle);
+                roots.insert(std::exchange(root.handle, nullptr).address());
+            }
+
+            /**
+             * Runs tasks until none is ready or waiting. When no task is ready, the calling
+             * uthread waits for any of the uthreads that tasks wait for to exit, so it is woken
+             * as soon as one of them does, or for the uthread to be resumed if tasks wait for it.
+             * Rethrows the first exception a spawned task ended with.
+             */
+            void run()
+            {
+                while (!ready.empty() || !joins.empty() || !resume_waits.empty())
+                {
+                    if (!ready.empty())
+                    {
+                        std::coroutine_handle<> next = ready.front();
+                        ready.pop_front();
+                        next.resume();
+                    }
+                    else if (joins.empty())
+                    {
+                        // The main thread cannot be blocked, so its tasks cannot wait for resumes.
+                        if (uthread_block(uthread_get_tid()) == FAIL_CODE)
+                        {
+                            resume_waits.clear();
+                            break;
+                        }
+                        wake_resume_waits();
+                    }
+                    else
+                    {
+                        wait_for_joins();
+                    }
+                }
+                // Tasks left waiting for resumes of the main thread never finish.
+                destroy_roots();
+                if (exception)
+                {
+                    std::rethrow_exception(std::exchange(exception, nullptr));
+                }
+            }
+
+            /**
+             * Destroys a spawned task that is done, keeping the first exception a task ended with.
+             */
+            void finish(std::coroutine_handle<> root, const std::exception_ptr &ended_with)
+            {
+                if (!exception)
+                {
+                    exception = ended_with;
+                }
+                roots.erase(root.address());
+                root.destroy();
+            }
+
+            /**
+             * Adds a suspended task to the end of the ready tasks.
+             */
+            void schedule(std::coroutine_handle<> handle)
+            {
+                ready.push_back(handle);
+            }
+
+            /**
+             * Parks a suspended task until the uthread with ID tid exits.
+             */
+            void wait_for_exit(int tid, std::coroutine_handle<> handle, void **value, int *status)
+            {
+                joins.push_back(join_wait{tid, handle, value, status});
+            }
+
+            /**
+             * Parks a suspended task until the uthread running the queue is resumed.
+             */
+            void wait_for_resume(std::coroutine_handle<> handle)
+            {
+                resume_waits.push_back(handle);
+            }
+
+        private:
+            struct join_wait
+            {
+                int tid;
+                std::coroutine_handle<> handle;
+                void **value;
+                int *status;
+            };
+
+            /**
+             * Blocks until any uthread a task waits for exits, and readies the tasks it wakes. A
+             * resume of the calling uthread ends the wait early, and readies the tasks waiting for it.
+             */
+            void wait_for_joins()
+            {
+                std::vector<int> tids;
+                for (const join_wait &wait : joins)
+                {
+                    tids.push_back(wait.tid);
+                }
+                int joined = NO_THREAD;
+                void *value;
+                if (uthread_join_any(tids.data(), (int)tids.size(), &joined, &value) == FAIL_CODE)
+                {
+                    // Only the joins of the rejected ID fail, the others stay parked. If no ID was
+                    // reported, all of them fail rather than block.
+                    for (std::deque<join_wait>::iterator it = joins.begin(); it != joins.end();)
+                    {
+                        if (it->tid == joined || joined == NO_THREAD)
+                        {
+                            *it->status = FAIL_CODE;
+                            ready.push_back(it->handle);
+                            it = joins.erase(it);
+                        }
+                        else
+                        {
+                            ++it;
+                        }
+                    }
+                    return;
+                }
+                if (joined == NO_THREAD)
+                {
+                    wake_resume_waits();
+                    return;
+                }
+                for (std::deque<join_wait>::iterator it = joins.begin(); it != joins.end(); ++it)
+                {
+                    if (it->tid == joined)
+                    {
+                        if (it->value != nullptr)
+                        {
+                            *it->value = value;
+                        }
+                        *it->status = SUCCESS_CODE;
+                        ready.push_back(it->handle);
+                        joins.erase(it);
+                        return;
+                    }
+                }
+            }
+
+            /**
+             * Destroys the frames of the spawned tasks that are not done.
+             */
+            void destroy_roots()
+            {
+                for (void *root : roots)
+                {
+                    std::coroutine_handle<>::from_address(root).destroy();
+                }
+                roots.clear();
+            }
+
+            /**
+             * Readies all tasks waiting for the uthread to be resumed.
+             */
+            void wake_resume_waits()
+            {
+                ready.insert(ready.end(), resume_waits.begin(), resume_waits.end());
+                resume_waits.clear();
+            }
+
+            std::deque<std::coroutine_handle<>> ready;
+            std::deque<join_wait> joins;
+            std::deque<std::coroutine_handle<>> resume_waits;
+            std::unordered_set<void *> roots;   // Frames of the spawned tasks that are not done.
+            std::exception_ptr exception;   // The first exception a spawned task ended with.
+    };
+
+
+    namespace detail
+    {
+        /**
+         * Moves the awaiting task to the end of the ready tasks.
+         */
+        struct yield_awaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            template <typename Promise>
+            void await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
+            {
+                awaiting.promise().queue->schedule(awaiting);
+            }
+
+            void await_resume() noexcept {}
+        };
+
+        /**
+         * Parks the awaiting task until a uthread exits, and resumes it with the return value
+         * of uthread_join.
+         */
+        struct join_awaiter
+        {
+            int tid;
+            void **value;
+            int status;
+
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            template <typename Promise>
+            void await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
+            {
+                awaiting.promise().queue->wait_for_exit(tid, awaiting, value, &status);
+            }
+
+            int await_resume() noexcept
+            {
+                return status;
+            }
+        };
+
+        /**
+         * Parks the awaiting task until the uthread running its queue is resumed.
+         */
+        struct resume_awaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            template <typename Promise>
+            void await_suspend(std::coroutine_handle<Promise> awaiting) noexcept
+            {
+                awaiting.promise().queue->wait_for_resume(awaiting);
+            }
+
+            void await_resume() noexcept {}
+        };
+    }
+
+
+    /**
+     * Awaitable that moves the awaiting task to the end of the ready tasks.
+     */
+    inline detail::yield_awaiter yield()
+    {
+        return detail::yield_awaiter{};
+    }
+
+
+    /**
+     * Awaitable that waits for the uthread with ID tid to exit, as uthread_join does, without
+     * blocking the other tasks. Resumes with the return value of uthread_join.
+     */
+    inline detail::join_awaiter join(int tid, void **value = nullptr)
+    {
+        return detail::join_awaiter{tid, value, FAIL_CODE};
+    }
+
+
+    /**
+     * Awaitable that waits for the uthread running the task's queue to be resumed with
+     * uthread_resume, e.g. by the uthread that produced what the task waits for. A resume that
+     * comes while the queue still has ready tasks is not remembered, as with uthread_block.
+     */
+    inline detail::resume_awaiter resumed()
+    {
+        return detail::resume_awaiter{};
+    }
+}
+
+#endif //OS_EX2_UTASK_H
@@ -0,0 +1,128 @@
+#ifndef OS_EX2_UTASK_GROUP_H
+#define OS_EX2_UTASK_GROUP_H
+
+#include <deque>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "uthreads.h"
+
+/*
+ * A fork-join group of tasks, run by a fixed set of worker threads that the
+ * group spawns when it is created. Tasks are callables, kept inside the group
+ * as uthread_spawn keeps them inside a thread, so running a task spawns no
+ * thread. Workers with no task block until one is run, and the thread that
+ * waits for the group is resumed by the worker finishing its last task. A
+ * group must only be used by threads of the library.
+*/
+class uthread_task_group
+{
+    public:
+        /*
+         * Description: Creates a group and spawns its workers, as uthread_spawn
+         * does. Fewer workers are spawned if MAX_THREAD_NUM would be exceeded.
+        */
+        explicit uthread_task_group(int workers);
+
+        /*
+         * Description: Waits for all tasks of the group, then ends its workers
+         * and joins them.
+        */
+        ~uthread_task_group();
+
+        uthread_task_group(const uthread_task_group &) = delete;
+
+        uthread_task_group &operator=(const uthread_task_group &) = delete;
+
+        /*
+         * Description: Adds the callable fn to the end of the tasks of the
+         * group, and resumes a blocked worker to run it. Callables that do not
+         * fit in UTHREAD_CLOSURE_SIZE bytes are moved to the heap. It is an
+         * error to run a task in a group without workers.
+         * Return value: On success, return 0. On failure, return -1.
+        */
+        template <typename F>
+        int run(F fn)
+        {
+            return submit_callable(fn, uthread_detail::fits_inline<F>());
+        }
+
+        /*
+         * Description: Blocks the calling thread until every task run in the
+         * group so far is done. It is an error for a worker of the group to
+         * wait for it, or for two threads to wait for it at once.
+         * Return value: On success, return 0. On failure, return -1.
+        */
+        int wait();
+
+        /*
+         * Description: Calls fn(i) for every i in [begin, end), split into
+         * tasks of grain consecutive indices, and waits for all of them. A
+         * grain below 1 is taken as 1.
+         * Return value: On success, return 0. On failure, return -1.
+        */
+        template <typename F>
+        int parallel_for(int begin, int end, int grain, F fn)
+        {
+            grain = grain < 1 ? 1 : grain;
+            F *body = &fn;
+            for (int low = begin; low < end; low += grain)
+            {
+                int high = end - low > grain ? low + grain : end;
+                if (run([body, low, high]() { for (int i = low; i < high; i++) (*body)(i); }) < 0)
+                {
+                    wait();
+                    return -1;
+                }
+            }
+            return wait();
+        }
+
+    private:
+        struct task
+        {
+            void (*run)(void *);    // Runs the callable and destroys it.
+            void (*relocate)(void *, void *);
+            void (*destroy)(void *);
+            alignas(UTHREAD_CLOSURE_ALIGNMENT) char closure[UTHREAD_CLOSURE_SIZE];
+        };
+
+        /*
+         * Moves the callable at closure into a new task at the end of the tasks.
+        */
+        int submit(void (*run)(void *), void (*relocate)(void *, void *), void (*destroy)(void *),
+                   void *closure);
+
+        template <typename F>
+        int submit_callable(F &fn, std::true_type /* fits inline */)
+        {
+            return submit(uthread_detail::run_inline<F>, uthread_detail::relocate<F>,
+                          uthread_detail::destroy<F>, &fn);
+        }
+
+        template <typename F>
+        int submit_callable(F &fn, std::false_type /* fits inline */)
+        {
+            F *copy = new F(std::move(fn));
+            if (run([copy]() { uthread_detail::run_allocated<F>(copy); }) < 0)
+            {
+                delete copy;
+                return -1;
+            }
+            return 0;
+        }
+
+        /*
+         * Entry point of the workers, runs tasks until the group is destroyed.
+        */
+        static void work(void *group);
+
+        std::deque<task> tasks;     // Tasks not yet taken by a worker.
+        std::vector<int> workers;
+        std::vector<int> idle;      // IDs of the workers blocked until a task is run.
+        int pending;    // Number of tasks run and not yet done.
+        int waiter;     // ID of the thread blocked in wait, or -1.
+        bool closing;
+};
+
+#endif //OS_EX2_UTASK_GROUP_H
@@ -2,33 +2,77 @@
 // Created by Tomer Greenberg on 4/6/19.
 //
 
+//============================//
+#define DEBUG
+//============================//
+
 #include "uthreads.h"
+#include "utask_group.h"
+#include "scheduler.h"
 #include "thread.h"
 #include "general.h"
+#include "Inbox.h"
 #include <queue>
+#include <algorithm>
 #include <signal.h>
 #include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <math.h>
 
-//============================//
-#define DEBUG
-//============================//
+#define SAFEPOINT_TICKS 1
+#define LOWEST_LEVEL (c_scheduler::queue_type::levels - 1)
+
+static_assert((MIN_CLASS_SIZE << (SIZE_CLASSES - 1)) == UTHREAD_MAX_ALLOC, "the largest size class must fit UTHREAD_MAX_ALLOC");
+static_assert(ARENA_SIZE >= 2 * ARENA_ALIGNMENT + UTHREAD_MAX_ALLOC, "an arena chunk must fit the largest block");
 
-#define ENV_SAVE_CODE 0
-#define ENV_LOAD_CODE 1
-#define SEC_TO_MICROSECS 1000000
 
+// The C API is the scheduler instantiated with the policies the macros of uthreads.h select. A
+// single level needs no level bookkeeping, so it is plain round-robin.
+#if PRIORITY_LEVELS == 1
+typedef round_robin_queue level_queue;
+#else
+typedef mlfq_queue<PRIORITY_LEVELS, AGING_PERIOD> level_queue;
+#endif
+
+#if UTHREAD_DEADLINES
+typedef deadline_queue<level_queue> ready_queue;
+#else
+typedef level_queue ready_queue;
+#endif
+
+#ifdef UTHREAD_STATS_SINK
+/**
+ * Reports every quantum to the function UTHREAD_STATS_SINK names.
+ */
+struct program_stats
+{
+    static void quantum_started(int tid, int total_quanta)
+    {
+        UTHREAD_STATS_SINK(tid, total_quanta);
+    }
+};
+#else
+typedef no_stats program_stats;
+#endif
+
+typedef scheduler<ready_queue, heap_stacks<STACK_SIZE>,
+                  interval_timer<UTHREAD_TIMER, UTHREAD_TIMER_SIGNAL, UTHREAD_SIMULATED_CLOCK != 0>,
+                  program_stats> c_scheduler;
 
-Thread *threads[MAX_THREAD_NUM];
-int quantum_length;    // The number of microseconds in each quantum.
-std::deque<int> readyQueue;   // A queue of ready thread ID's.
-int runningThread;  // The ID of the currently running thread.
-int total_quanta = 1;   // Quantum counter for all threads in total.
-sigset_t signal_set;    // Signal set used for signal masking.
+c_scheduler core;
+int local_key_count = 0;    // The number of thread-local storage keys created so far.
+Inbox inbox;    // Requests posted by other pthreads and signal handlers.
+int inbox_fd = FAIL_CODE;   // Eventfd rung after every request posted to the inbox.
+void (*deferred_spawns[INBOX_SIZE])(void);  // Spawn requests taken from the inbox in a signal handler.
+int deferred_spawn_count = 0;
 
-// TODO - Check if these need be global.
-struct sigaction sa;
-struct itimerval tv;     // Saves the timer interval
+// Defined with the configuration this file is compiled with, and referenced by uthreads.h, so a
+// program built with other limits fails to link instead of overflowing the library's buffers.
+int UTHREAD_CONFIG_SYMBOL = 0;
 
 
 //////////////////////////////////
@@ -37,157 +81,326 @@ struct itimerval tv;     // Saves the timer interval
 
 
 /**
- * Checks if given thread exists and is in the valid range.
+ * Checks if given thread-local storage key was created.
+ */
+bool is_key_valid(int key)
+{
+    if (key < 0 || key >= local_key_count)
+    {
+        std::cerr << LIB_ERROR_MSG << "invalid thread-local storage key provided.\n";
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Checks if given thread exists and may be joined by the running thread.
+ */
+bool is_joinable(int tid)
+{
+    if (!core.is_tid_valid(tid))
+    {
+        return false;
+    }
+    else if (tid == core.running_tid)
+    {
+        std::cerr << LIB_ERROR_MSG << "a thread cannot join itself.\n";
+        return false;
+    }
+    else if (tid == 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "main thread cannot be joined.\n";
+        return false;
+    }
+    else if (core.threads[tid]->is_detached())
+    {
+        std::cerr << LIB_ERROR_MSG << "a detached thread cannot be joined.\n";
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Checks if given thread exists and may be blocked.
  */
-bool is_tid_valid(int tid)
+bool is_blockable(int tid)
 {
-    // If the provided ID is invalid
-    if (tid < 0 || tid >= MAX_THREAD_NUM)
+    // Thread ID invalid or non existent.
+    if (!core.is_tid_valid(tid))
+    {
+        return false;
+    }
+    // Trying to block the main thread.
+    else if (tid == 0)
     {
-        std::cerr << LIB_ERROR_MSG << "invalid thread ID provided.\n";
+        std::cerr << LIB_ERROR_MSG << "main thread cannot be blocked.\n";
         return false;
     }
-    // If thread doesn't exist.
-    else if (threads[tid] == nullptr)
+    // Trying to block a thread that already exited.
+    else if (core.threads[tid]->getState() == TERMINATED)
     {
-        std::cerr << LIB_ERROR_MSG << "could not find thread with the given ID.\n";
+        std::cerr << LIB_ERROR_MSG << "thread has already exited.\n";
         return false;
     }
     return true;
 }
 
+
 /**
- * Tries to remove a thread ID from the ready queue.
- * @param tid - the thread ID to be removed.
- * @return 0 upon success, -1 upon failure.
+ * Ends the wait of a thread that is waiting to join, and removes it from the waiters of the
+ * threads it was waiting for.
  */
-int remove_from_ready_queue(int tid)
+void stop_joining(int tid)
 {
-    for (unsigned int i=0; i<readyQueue.size(); i++)
+    int joined = core.threads[tid]->get_joining();
+    if (joined == NO_THREAD)
+    {
+        return;
+    }
+    // A thread joining any thread may be a waiter of several threads.
+    int first = joined == ANY_THREAD ? 0 : joined;
+    int last = joined == ANY_THREAD ? MAX_THREAD_NUM - 1 : joined;
+    for (int i=first; i<=last; i++)
     {
-        if (readyQueue[i] == tid)
+        if (core.threads[i] == nullptr)
         {
-            readyQueue.erase(readyQueue.begin()+i);
-            return SUCCESS_CODE;
+            continue;
+        }
+        std::vector<int> &waiters = core.threads[i]->get_waiters();
+        std::vector<int>::iterator it = std::find(waiters.begin(), waiters.end(), tid);
+        if (it != waiters.end())
+        {
+            waiters.erase(it);
         }
     }
-    return FAIL_CODE;
+    core.threads[tid]->set_joining(NO_THREAD, nullptr);
+    core.threads[tid]->set_joined_id(nullptr);
 }
 
 
 /**
- * Blocks alarm signals.
+ * Delivers an exit value to every thread waiting to join the given thread, and moves them
+ * back to the ready queue.
  */
-void block_timer()
+void wake_joiners(int tid, void *value)
 {
-#ifdef DEBUG
-    std::cout << "blocking timer\n";
-#endif
-    if (sigprocmask(SIG_BLOCK, &signal_set, NULL) == FAIL_CODE)
+    std::vector<int> waiters;
+    waiters.swap(core.threads[tid]->get_waiters());
+    for (unsigned int i=0; i<waiters.size(); i++)
     {
-        std::cerr << SYS_ERROR_MSG << "failed to block signal set.\n";
-        exit(1);
+        Thread *waiter = core.threads[waiters[i]];
+        if (waiter->get_join_result() != nullptr)
+        {
+            *(waiter->get_join_result()) = value;
+        }
+        if (waiter->get_joined_id() != nullptr)
+        {
+            *(waiter->get_joined_id()) = tid;
+        }
+        stop_joining(waiters[i]);
+        // A joiner that was resumed while waiting is already in the ready queue, and one blocked by
+        // uthread_block meanwhile stays blocked until it is resumed.
+        if (waiter->getState() == BLOCKED && !waiter->is_explicitly_blocked())
+        {
+            waiter->setState(READY);
+            core.push_ready(waiters[i]);
+        }
     }
 }
 
 
 /**
- * Stops the blocking of alarm signals.
+ * Releases a thread and removes it from all control structures. This function is not responsible
+ * to switch threads if the released thread is the running one.
  */
-void unblock_timer()
+void release_thread(int tid)
 {
-#ifdef DEBUG
-    std::cout << "unblocking timer\n";
-#endif
-    if (sigprocmask(SIG_UNBLOCK, &signal_set, NULL) == FAIL_CODE)
+    // If the thread is waiting to join another thread.
+    stop_joining(tid);
+    core.remove_ready(tid);
+    core.delete_thread(tid);
+}
+
+
+/**
+ * Entry point of every spawned thread. Runs the function of the thread, and exits it when the
+ * function returns.
+ */
+void thread_entry()
+{
+    core.threads[core.running_tid]->run();
+    uthread_exit(nullptr);
+}
+
+
+/**
+ * Runs a function with no arguments, whose pointer is stored at closure.
+ */
+void run_function(void *closure)
+{
+    (*static_cast<void (**)(void)>(closure))();
+}
+
+
+/**
+ * Creates the thread with the given ID, which runs f(arg). The thread is not added to the ready queue.
+ */
+Thread *create_thread(int tid, void (*f)(void *), void *arg)
+{
+    Thread *thread = core.create_thread(tid, thread_entry);
+    thread->set_entry(f, arg);
+    return thread;
+}
+
+
+/**
+ * Creates the thread with the given ID, which runs the function f. The pointer to f is kept in
+ * the closure storage of the thread. The thread is not added to the ready queue.
+ */
+void create_function_thread(int tid, void (*f)(void))
+{
+    Thread *thread = create_thread(tid, run_function, nullptr);
+    *static_cast<void (**)(void)>(thread->get_closure()) = f;
+    thread->set_entry(run_function, thread->get_closure());
+}
+
+
+/**
+ * Returns the lowest unused thread ID.
+ * @return the ID, or -1 if the max number of threads is reached.
+ */
+int free_thread_id()
+{
+    for (int i=0; i<MAX_THREAD_NUM; i++)
     {
-        std::cerr << SYS_ERROR_MSG << "failed to unblock signal set.\n";
-        exit(1);
+        if (core.threads[i] == nullptr)
+        {
+            return i;
+        }
     }
+    std::cerr << LIB_ERROR_MSG << "max number of threads reached.\n";
+    return FAIL_CODE;
 }
 
 
 /**
- * Resets the virtual timer and unblocks the signals.
+ * Creates a thread running the function f and adds it to the ready queue.
+ * @return the ID of the new thread, or -1 if the max number of threads is reached.
  */
-void reset_timer()
+int spawn_thread(void (*f)(void))
 {
-#ifdef DEBUG
-    std::cout << "resetting timer\n";
-#endif
-    if (setitimer(ITIMER_VIRTUAL, &tv, NULL) == FAIL_CODE)
+    int tid = free_thread_id();
+    if (tid != FAIL_CODE)
     {
-        std::cerr << SYS_ERROR_MSG << "failed to reset virtual timer.\n";
-        exit(1);
+        create_function_thread(tid, f);
+        core.push_ready(tid);
     }
-    unblock_timer();
+    return tid;
 }
 
 
 /**
- * Initiates the virtual timer.
+ * Applies the requests posted to the inbox. Creating a thread allocates, so in a signal handler
+ * spawn requests are only set aside, and spawned by the next switch outside of it.
+ * @param from_signal - whether the scheduler runs in the timer signal handler.
  */
-void init_timer(int quantum_usecs)
+void drain_inbox(bool from_signal)
 {
-    int seconds = floor(quantum_usecs/SEC_TO_MICROSECS);
-    int usecs = quantum_usecs - seconds*SEC_TO_MICROSECS;
-#ifdef DEBUG
-    std::cout << "initiating timer with " << seconds << " secs and " << usecs << " microsecs\n";
-#endif
-    tv.it_value.tv_sec = seconds;
-    tv.it_value.tv_usec = usecs;
-    tv.it_interval.tv_sec = seconds;
-    tv.it_interval.tv_usec = usecs;
-    // This needs to be a separate function since virtual timer resets on self-blocking/terminating.
-    reset_timer();
+    if (!from_signal)
+    {
+        for (int i=0; i<deferred_spawn_count; i++)
+        {
+            spawn_thread(deferred_spawns[i]);
+        }
+        deferred_spawn_count = 0;
+    }
+    InboxRequest request;
+    // Leaves the requests in the inbox once there is no room to set spawn requests aside.
+    while ((!from_signal || deferred_spawn_count < INBOX_SIZE) && inbox.pop(request))
+    {
+        if (request.type == SPAWN_REQUEST)
+        {
+            if (from_signal)
+            {
+                deferred_spawns[deferred_spawn_count++] = request.f;
+            }
+            else
+            {
+                spawn_thread(request.f);
+            }
+        }
+        // Nothing is printed in the signal handler, a resume for a dead thread is just dropped.
+        else if ((from_signal ? request.tid >= 0 && request.tid < MAX_THREAD_NUM &&
+                                core.threads[request.tid] != nullptr : core.is_tid_valid(request.tid)) &&
+                 core.threads[request.tid]->getState() == BLOCKED)
+        {
+            core.threads[request.tid]->set_explicitly_blocked(false);
+            core.threads[request.tid]->setState(READY);
+            core.push_ready(request.tid);
+        }
+    }
 }
 
 
 /**
- * Signals the thread at the top of the ready list to run. This function is not responsible
- * to save the env or modify the data for the currently running thread.
+ * Waits until a request is posted to the inbox. Returns at once if there is one already.
  */
-void switch_thread()
+void wait_for_inbox()
 {
-#ifdef DEBUG
-    std::cout << "switching threads\n";
-#endif
-    int next;
-    if (readyQueue.empty())
+    uint64_t rings;
+    // Clears the doorbell before checking the inbox, so a request posted meanwhile rings it again.
+    if (read(inbox_fd, &rings, sizeof(rings)) == FAIL_CODE && errno != EAGAIN)
     {
-        next = runningThread;
+        std::cerr << SYS_ERROR_MSG << "failed to read inbox doorbell.\n";
+        exit(1);
     }
-    // If there are threads in the ready queue
-    else
+    if (!inbox.empty())
+    {
+        return;
+    }
+    struct pollfd doorbell;
+    doorbell.fd = inbox_fd;
+    doorbell.events = POLLIN;
+    while (poll(&doorbell, 1, -1) == FAIL_CODE)
     {
-        next = readyQueue[0];
-        readyQueue.pop_front();
+        if (errno != EINTR)
+        {
+            std::cerr << SYS_ERROR_MSG << "failed to wait for inbox doorbell.\n";
+            exit(1);
+        }
     }
-    runningThread = next;
-    threads[runningThread]->setState(RUNNING);
-    threads[runningThread]->inc_quantum_count();
-    total_quanta++;
-    reset_timer();
-    siglongjmp(*(threads[runningThread]->getEnv()), ENV_LOAD_CODE);
 }
 
 
 /**
- * Handles virtual timer expiration.
+ * Called on entry to every library function. Advances the simulated clock, and switches threads
+ * if the quantum of the running thread ended while in cooperative mode.
  */
-void timer_handler(int signum)
+void library_safepoint()
 {
-#ifdef DEBUG
-    std::cout << "handling alarm signal\n";
-#endif
-    threads[runningThread]->setState(READY);
-    readyQueue.push_back(runningThread);
-    int ret_val = sigsetjmp(*(threads[runningThread]->getEnv()), 1);
-    // If thread state env was just saved.
-    if (ret_val == ENV_SAVE_CODE)
+    core.safepoint(SAFEPOINT_TICKS);
+}
+
+
+/**
+ * Initiates the inbox and the scheduler, and starts the first quantum.
+ */
+void init_library(int quantum)
+{
+#if UTHREAD_INBOX
+    // Creates the doorbell of the inbox.
+    inbox_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (inbox_fd == FAIL_CODE)
     {
-        switch_thread();
+        std::cerr << SYS_ERROR_MSG << "failed to create inbox doorbell.\n";
+        exit(1);
     }
+    core.on_switch = drain_inbox;
+    core.on_idle = wait_for_inbox;
+#endif
+    core.start(quantum);
 }
 
 
@@ -197,10 +410,10 @@ void print_thread_status()
     std::cout << "thread states: {";
     for (int i=0; i<10; i++)
         {
-            if (threads[i] != nullptr)
+            if (core.threads[i] != nullptr)
             {
                 std::cout << i << ":";
-                State state = threads[i]->getState();
+                State state = core.threads[i]->getState();
                 switch(state)
                 {
                     case(READY) :
@@ -211,6 +424,9 @@ void print_thread_status()
                         break;
                     case(BLOCKED) :
                         std::cout << "BLOCKED";
+                        break;
+                    case(TERMINATED) :
+                        std::cout << "TERMINATED";
                     default :
                         break;
                 }
@@ -219,10 +435,7 @@ void print_thread_status()
         }
     std::cout << "}\n";
     std::cout << "ready queue: {";
-    for(unsigned int i=0; i<readyQueue.size(); i++)
-        {
-            std::cout << readyQueue[i] << ", ";
-        }
+    core.ready.for_each([](int tid) { std::cout << tid << ", "; });
     std::cout << "}\n";
 }
 
@@ -240,134 +453,147 @@ int uthread_init(int quantum_usecs)
         return FAIL_CODE;
     }
 
-    // Initiates main thread. Every other thread in threads array is auto-initiated to nullptr.
-    Thread* main_thread = new Thread(0);
-    threads[0] = main_thread;
-    main_thread->setState(RUNNING);
-    runningThread = 0;
+    init_library(quantum_usecs);
 
-    // Set timer_handler to handle timer signals.
-    sa.sa_handler = &timer_handler;
-    if (sigaction(SIGVTALRM, &sa, NULL) < 0) {
-        std::cerr << SYS_ERROR_MSG << "failed to set signal action handler.\n";
-        exit(1);
-    }
+    return SUCCESS_CODE;
+}
 
-    // Saves signal set for masking.
-    if (sigemptyset(&signal_set) == FAIL_CODE)
-    {
-        std::cerr << SYS_ERROR_MSG << "failed to empty signal set.\n";
-        exit(1);
-    }
-    if (sigaddset(&signal_set, SIGVTALRM) == FAIL_CODE)
+
+int uthread_init_simulated(int quantum_ticks, unsigned int seed)
+{
+    // Checks input.
+    if (quantum_ticks <= 0)
     {
-        std::cerr << SYS_ERROR_MSG << "failed to add signal to signal set.\n";
-        exit(1);
+        std::cerr << LIB_ERROR_MSG << "parameter quantum_ticks must be a positive integer.\n";
+        return FAIL_CODE;
     }
+#if UTHREAD_SIMULATED_CLOCK
+    core.timer.simulate(seed);
+    // Starts the first quantum of the simulated clock.
+    init_library(quantum_ticks);
+    return SUCCESS_CODE;
+#else
+    (void)seed;
+    std::cerr << LIB_ERROR_MSG << "the library was built without the simulated clock.\n";
+    return FAIL_CODE;
+#endif
+}
 
-    // Initiates timer.
-    init_timer(quantum_usecs);
 
+int uthread_tick(unsigned int ticks)
+{
+    if (!core.timer.is_simulated())
+    {
+        std::cerr << LIB_ERROR_MSG << "the library was not initialized with a simulated clock.\n";
+        return FAIL_CODE;
+    }
+    core.advance_clock(ticks);
     return SUCCESS_CODE;
 }
 
 
 int uthread_spawn(void (*f)(void))
 {
-    block_timer();
+    library_safepoint();
+    core.block_timer();
 #ifdef DEBUG
     std::cout << "spawning thread\n";
 #endif
-    for (int i=0; i<MAX_THREAD_NUM; i++)
+    int tid = spawn_thread(f);
+    core.unblock_timer();
+    return tid;
+}
+
+
+int uthread_spawn_arg(void (*f)(void *), void *arg)
+{
+    library_safepoint();
+    core.block_timer();
+    int tid = free_thread_id();
+    if (tid != FAIL_CODE)
     {
-        if (threads[i] == nullptr)
-        {
-            threads[i] = new Thread(i, f);
-            readyQueue.push_back(i);
-            unblock_timer();
-            return i;
-        }
+        create_thread(tid, f, arg);
+        core.push_ready(tid);
     }
-    std::cerr << LIB_ERROR_MSG << "max number of threads reached.\n";
-    unblock_timer();
-    return FAIL_CODE;
+    core.unblock_timer();
+    return tid;
+}
+
+
+int uthread_spawn_closure(void (*run)(void *), void (*relocate)(void *, void *), void *closure)
+{
+    library_safepoint();
+    core.block_timer();
+    int tid = free_thread_id();
+    if (tid != FAIL_CODE)
+    {
+        Thread *thread = create_thread(tid, run, nullptr);
+        // The callable is moved before the thread is READY, so the caller may destroy its own copy.
+        relocate(thread->get_closure(), closure);
+        thread->set_entry(run, thread->get_closure());
+        core.push_ready(tid);
+    }
+    core.unblock_timer();
+    return tid;
 }
 
 
 int uthread_terminate(int tid)
 {
-    block_timer();
-    if (!is_tid_valid(tid))
+    library_safepoint();
+    core.block_timer();
+    if (!core.is_tid_valid(tid))
     {
-        unblock_timer();
+        core.unblock_timer();
         return FAIL_CODE;
     }
     // If the provided ID is the main thread
     else if (tid == 0)
     {
-        for (int i=0; i<MAX_THREAD_NUM; i++)
-        {
-            if (threads[i] != nullptr)
-            {
-                delete threads[i];
-                threads[i] = nullptr;
-            }
-        }
+        core.delete_all();
         exit(SUCCESS_CODE);
     }
     // If this is a valid thread.
     else
     {
-        delete threads[tid];
-        threads[tid] = nullptr;
-        remove_from_ready_queue(tid);
+        // Joiners of a terminated thread get nullptr as its exit value.
+        wake_joiners(tid, nullptr);
+        release_thread(tid);
         // If the running thread is being terminated.
-        if (tid == runningThread)
+        if (tid == core.running_tid)
         {
             // No need to unblock timer since it's reset.
-            switch_thread();
+            core.switch_thread(false);
         }
     }
-    unblock_timer();
+    core.unblock_timer();
     return SUCCESS_CODE;
 }
 
 
 int uthread_block(int tid)
 {
-    block_timer();
-    // Thread ID invalid or non existent.
-    if (!is_tid_valid(tid))
+    library_safepoint();
+    core.block_timer();
+    if (!is_blockable(tid))
     {
-        unblock_timer();
-        return FAIL_CODE;
-    }
-    // Trying to block the main thread.
-    else if (tid == 0)
-    {
-        std::cerr << LIB_ERROR_MSG << "main thread cannot be blocked.\n";
-        unblock_timer();
+        core.unblock_timer();
         return FAIL_CODE;
     }
     // Valid tid.
     else
     {
-        threads[tid]->setState(BLOCKED);
-        remove_from_ready_queue(tid);
+        core.threads[tid]->setState(BLOCKED);
+        core.threads[tid]->set_explicitly_blocked(true);
+        core.remove_ready(tid);
         // Trying to block the running thread.
-        if (tid == runningThread)
+        if (tid == core.running_tid)
         {
             // If tid is the running thread, its env hasn't been saved previously.
-            int ret_val = sigsetjmp(*(threads[tid]->getEnv()), 1);
-            // If the thread env was just saved.
-            if (ret_val == ENV_SAVE_CODE)
-            {
-                // Timer is reset and unblocked.
-                switch_thread();
-            }
+            core.suspend_running_thread();
         }
     }
-    unblock_timer();
+    core.unblock_timer();
     // TODO - Check if a thread blocking itself should get 0 returned when it runs next.
     return SUCCESS_CODE;
 }
@@ -375,42 +601,713 @@ int uthread_block(int tid)
 
 int uthread_resume(int tid)
 {
-    block_timer();
+    library_safepoint();
+    core.block_timer();
     // If tid invalid and existing.
-    if (!is_tid_valid(tid))
+    if (!core.is_tid_valid(tid))
     {
-        unblock_timer();
+        core.unblock_timer();
         return FAIL_CODE;
     }
     // If thread is blocked.
-    else if (threads[tid]->getState() == BLOCKED)
+    else if (core.threads[tid]->getState() == BLOCKED)
     {
-        threads[tid]->setState(READY);
-        readyQueue.push_back(tid);
+        core.threads[tid]->set_explicitly_blocked(false);
+        core.threads[tid]->setState(READY);
+        core.push_ready(tid);
     }
-    unblock_timer();
+    core.unblock_timer();
     //TODO make sure resuming ready/running thread should return 0.
     return SUCCESS_CODE;
 }
 
 
-int uthread_get_tid()
+int uthread_spawn_n(void (**fs)(void), int count, int *tids)
 {
-    return runningThread;
+    library_safepoint();
+    if (count < 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "parameter count must be a non-negative integer.\n";
+        return FAIL_CODE;
+    }
+    core.block_timer();
+    int free_ids[MAX_THREAD_NUM];
+    int found = 0;
+    for (int i=0; i<MAX_THREAD_NUM && found<count; i++)
+    {
+        if (core.threads[i] == nullptr)
+        {
+            free_ids[found++] = i;
+        }
+    }
+    // Either all threads are spawned or none of them.
+    if (found < count)
+    {
+        std::cerr << LIB_ERROR_MSG << "max number of threads reached.\n";
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    for (int i=0; i<count; i++)
+    {
+        create_function_thread(free_ids[i], fs[i]);
+        tids[i] = free_ids[i];
+    }
+    for (int i=0; i<count; i++)
+    {
+        core.push_ready(free_ids[i]);
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
 }
 
 
-int uthread_get_total_quantums()
+int uthread_block_many(const int *tids, int count)
 {
-    return total_quanta;
+    library_safepoint();
+    if (count < 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "parameter count must be a non-negative integer.\n";
+        return FAIL_CODE;
+    }
+    core.block_timer();
+    // Either all threads are blocked or none of them.
+    for (int i=0; i<count; i++)
+    {
+        if (!is_blockable(tids[i]))
+        {
+            core.unblock_timer();
+            return FAIL_CODE;
+        }
+    }
+    bool blocked[MAX_THREAD_NUM] = {false};
+    for (int i=0; i<count; i++)
+    {
+        core.threads[tids[i]]->setState(BLOCKED);
+        core.threads[tids[i]]->set_explicitly_blocked(true);
+        blocked[tids[i]] = true;
+    }
+    // Removes all blocked threads from the ready threads in a single pass.
+    core.ready.remove_if(blocked);
+    // If the running thread blocked itself, it is switched only after all others were blocked.
+    if (blocked[core.running_tid])
+    {
+        core.suspend_running_thread();
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
 }
 
-int uthread_get_quantums(int tid)
+
+int uthread_resume_many(const int *tids, int count)
 {
-    if (!is_tid_valid(tid))
+    library_safepoint();
+    if (count < 0)
     {
-        // Error printed by is_tid_valid.
+        std::cerr << LIB_ERROR_MSG << "parameter count must be a non-negative integer.\n";
         return FAIL_CODE;
     }
-    return threads[tid]->get_quantum_count();
-}
\ No newline at end of file
+    core.block_timer();
+    // Either all threads are resumed or none of them.
+    for (int i=0; i<count; i++)
+    {
+        if (!core.is_tid_valid(tids[i]))
+        {
+            core.unblock_timer();
+            return FAIL_CODE;
+        }
+    }
+    for (int i=0; i<count; i++)
+    {
+        // A thread listed twice is already READY the second time.
+        if (core.threads[tids[i]]->getState() == BLOCKED)
+        {
+            core.threads[tids[i]]->set_explicitly_blocked(false);
+            core.threads[tids[i]]->setState(READY);
+            core.push_ready(tids[i]);
+        }
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+void uthread_exit(void *value)
+{
+    library_safepoint();
+    // Exiting the main thread ends the process.
+    if (core.running_tid == 0)
+    {
+        uthread_terminate(0);
+    }
+    core.block_timer();
+    Thread *self = core.threads[core.running_tid];
+    // Exiting ends the job of a thread with a deadline.
+    core.end_deadline_job(self);
+    // If the exit value can be handed over right away.
+    if (self->is_detached() || !self->get_waiters().empty())
+    {
+        wake_joiners(core.running_tid, value);
+        release_thread(core.running_tid);
+    }
+    // Keeps the thread and its ID until it is joined or detached.
+    else
+    {
+        self->set_exit_value(value);
+        self->setState(TERMINATED);
+    }
+    // No need to unblock timer since it's reset.
+    core.switch_thread(false);
+}
+
+
+int uthread_join(int tid, void **value)
+{
+    library_safepoint();
+    core.block_timer();
+    if (!is_joinable(tid))
+    {
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    // If the thread already exited, its exit value is collected and its ID released.
+    if (core.threads[tid]->getState() == TERMINATED)
+    {
+        if (value != nullptr)
+        {
+            *value = core.threads[tid]->get_exit_value();
+        }
+        release_thread(tid);
+    }
+    // Waits until the exiting thread delivers its exit value.
+    else
+    {
+        Thread *self = core.threads[core.running_tid];
+        self->set_joining(tid, value);
+        core.threads[tid]->get_waiters().push_back(core.running_tid);
+        // Resuming a joiner does not end the wait.
+        while (self->get_joining() != NO_THREAD)
+        {
+            self->setState(BLOCKED);
+            core.suspend_running_thread();
+        }
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_join_any(const int *tids, int count, int *joined, void **value)
+{
+    library_safepoint();
+    if (count <= 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "parameter count must be a positive integer.\n";
+        return FAIL_CODE;
+    }
+    core.block_timer();
+    for (int i=0; i<count; i++)
+    {
+        if (!is_joinable(tids[i]))
+        {
+            // Tells the caller which ID was rejected, so it can drop only that one.
+            if (joined != nullptr)
+            {
+                *joined = tids[i];
+            }
+            core.unblock_timer();
+            return FAIL_CODE;
+        }
+    }
+    // If one of the threads already exited, it is joined right away.
+    for (int i=0; i<count; i++)
+    {
+        if (core.threads[tids[i]]->getState() == TERMINATED)
+        {
+            if (joined != nullptr)
+            {
+                *joined = tids[i];
+            }
+            if (value != nullptr)
+            {
+                *value = core.threads[tids[i]]->get_exit_value();
+            }
+            release_thread(tids[i]);
+            core.unblock_timer();
+            return SUCCESS_CODE;
+        }
+    }
+    Thread *self = core.threads[core.running_tid];
+    if (joined != nullptr)
+    {
+        *joined = NO_THREAD;
+    }
+    self->set_joining(ANY_THREAD, value);
+    self->set_joined_id(joined);
+    for (int i=0; i<count; i++)
+    {
+        std::vector<int> &waiters = core.threads[tids[i]]->get_waiters();
+        if (std::find(waiters.begin(), waiters.end(), core.running_tid) == waiters.end())
+        {
+            waiters.push_back(core.running_tid);
+        }
+    }
+    self->setState(BLOCKED);
+    core.suspend_running_thread();
+    // Resuming the thread ends the wait without joining any thread.
+    stop_joining(core.running_tid);
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_detach(int tid)
+{
+    library_safepoint();
+    core.block_timer();
+    if (!core.is_tid_valid(tid))
+    {
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    else if (tid == 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "main thread cannot be detached.\n";
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    else if (!core.threads[tid]->get_waiters().empty())
+    {
+        std::cerr << LIB_ERROR_MSG << "a thread with waiting joiners cannot be detached.\n";
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    // If the thread already exited, nobody can collect its exit value anymore.
+    if (core.threads[tid]->getState() == TERMINATED)
+    {
+        release_thread(tid);
+    }
+    else
+    {
+        core.threads[tid]->set_detached();
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_set_priority(int tid, int priority)
+{
+    library_safepoint();
+    if (priority < 0 || priority > LOWEST_LEVEL)
+    {
+        std::cerr << LIB_ERROR_MSG << "priority out of range.\n";
+        return FAIL_CODE;
+    }
+    core.block_timer();
+    if (!core.is_tid_valid(tid))
+    {
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    // A ready thread moves to the end of the ready queue of its new level.
+    if (core.threads[tid]->getState() == READY)
+    {
+        core.remove_ready(tid);
+        core.threads[tid]->set_priority(priority);
+        core.push_ready(tid);
+    }
+    else
+    {
+        core.threads[tid]->set_priority(priority);
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_set_deadline(int tid, unsigned int usecs, int quanta)
+{
+    library_safepoint();
+    if (!UTHREAD_DEADLINES)
+    {
+        std::cerr << LIB_ERROR_MSG << "the library was built without deadlines.\n";
+        return FAIL_CODE;
+    }
+    if (usecs > 0 && quanta <= 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "the budget of a job must be a positive number of quanta.\n";
+        return FAIL_CODE;
+    }
+    core.block_timer();
+    if (!core.is_tid_valid(tid))
+    {
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    Thread *thread = core.threads[tid];
+    bool ready = thread->getState() == READY;
+    // The thread is taken out of the ready queue while it changes scheduling class.
+    if (ready)
+    {
+        core.remove_ready(tid);
+    }
+    // Starting a new job ends the previous one.
+    core.end_deadline_job(thread);
+    if (usecs > 0)
+    {
+        thread->set_deadline(core.time() + usecs);
+        thread->set_deadline_budget(quanta);
+    }
+    if (ready)
+    {
+        core.push_ready(tid);
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_get_deadline_misses(int tid)
+{
+    library_safepoint();
+    if (!UTHREAD_DEADLINES)
+    {
+        std::cerr << LIB_ERROR_MSG << "the library was built without deadlines.\n";
+        return FAIL_CODE;
+    }
+    if (!core.is_tid_valid(tid))
+    {
+        // Error printed by is_tid_valid.
+        return FAIL_CODE;
+    }
+    return core.threads[tid]->get_deadline_misses();
+}
+
+
+int uthread_set_quantum(int tid, int quantum_usecs)
+{
+    library_safepoint();
+    if (quantum_usecs < 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "parameter quantum_usecs must be a non-negative integer.\n";
+        return FAIL_CODE;
+    }
+    core.block_timer();
+    if (!core.is_tid_valid(tid))
+    {
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    // Takes effect when the thread starts its next quantum.
+    core.threads[tid]->set_quantum(quantum_usecs);
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_set_adaptive_quantum(int enabled)
+{
+    library_safepoint();
+    core.adaptive_quantum = enabled != 0;
+    return SUCCESS_CODE;
+}
+
+
+int uthread_set_cooperative(int enabled, int margin_usecs)
+{
+    library_safepoint();
+    if (enabled && margin_usecs <= 0)
+    {
+        std::cerr << LIB_ERROR_MSG << "parameter margin_usecs must be a positive integer.\n";
+        return FAIL_CODE;
+    }
+    core.block_timer();
+    core.cooperative = enabled != 0;
+    core.preemption_margin = margin_usecs;
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_safepoint()
+{
+    library_safepoint();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_get_tid()
+{
+    library_safepoint();
+    return core.running_tid;
+}
+
+
+int uthread_get_total_quantums()
+{
+    library_safepoint();
+    return core.total_quanta;
+}
+
+int uthread_get_quantums(int tid)
+{
+    library_safepoint();
+    if (!core.is_tid_valid(tid))
+    {
+        // Error printed by is_tid_valid.
+        return FAIL_CODE;
+    }
+    return core.threads[tid]->get_quantum_count();
+}
+
+
+int uthread_key_create(int *key)
+{
+    library_safepoint();
+    core.block_timer();
+    if (local_key_count == MAX_LOCAL_KEYS)
+    {
+        std::cerr << LIB_ERROR_MSG << "max number of thread-local storage keys reached.\n";
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    *key = local_key_count++;
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_setspecific(int key, void *value)
+{
+    library_safepoint();
+    if (!is_key_valid(key))
+    {
+        return FAIL_CODE;
+    }
+    // The running thread only changes its own slots, so the timer is blocked only when the
+    // overflow slots may need to be allocated.
+    if (key < INLINE_LOCAL_SLOTS)
+    {
+        core.current_thread->set_local(key, value);
+        return SUCCESS_CODE;
+    }
+    core.block_timer();
+    core.current_thread->set_local(key, value);
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+void *uthread_getspecific(int key)
+{
+    library_safepoint();
+    if (!is_key_valid(key))
+    {
+        return nullptr;
+    }
+    return core.current_thread->get_local(key);
+}
+
+
+void *uthread_alloc(size_t size)
+{
+    library_safepoint();
+    if (size > UTHREAD_MAX_ALLOC)
+    {
+        std::cerr << LIB_ERROR_MSG << "allocation size exceeds UTHREAD_MAX_ALLOC.\n";
+        return nullptr;
+    }
+    // The arena belongs to the running thread, so there is no need to block the timer.
+    Arena *arena = core.current_thread->get_arena();
+    void *block = arena->alloc(size);
+    if (block == nullptr)
+    {
+        // Only growing the arena uses the global heap.
+        core.block_timer();
+        arena->add_chunk(new char[ARENA_SIZE], ARENA_SIZE);
+        core.unblock_timer();
+        block = arena->alloc(size);
+    }
+    return block;
+}
+
+
+void uthread_free(void *block)
+{
+    library_safepoint();
+    if (block != nullptr)
+    {
+        core.current_thread->get_arena()->free(block);
+    }
+}
+
+
+/**
+ * Adds a request to the inbox and rings its doorbell. Runs outside of the scheduler, possibly in a
+ * signal handler, so it touches nothing else and prints nothing.
+ */
+int post_request(const InboxRequest &request)
+{
+    if (!UTHREAD_INBOX || !inbox.push(request))
+    {
+        return FAIL_CODE;
+    }
+    uint64_t ring = 1;
+    // The doorbell can only fail to ring if it was rung too many times already.
+    ssize_t written = write(inbox_fd, &ring, sizeof(ring));
+    (void)written;
+    return SUCCESS_CODE;
+}
+
+
+int uthread_post_spawn(void (*f)(void))
+{
+    InboxRequest request = {SPAWN_REQUEST, f, NO_THREAD};
+    return post_request(request);
+}
+
+
+int uthread_post_resume(int tid)
+{
+    InboxRequest request = {RESUME_REQUEST, nullptr, tid};
+    return post_request(request);
+}
+
+uthread_task_group::uthread_task_group(int workers): pending(0), waiter(NO_THREAD), closing(false)
+{
+    for (int i=0; i<workers; i++)
+    {
+        int tid = uthread_spawn_arg(work, this);
+        if (tid == FAIL_CODE)
+        {
+            break;
+        }
+        this->workers.push_back(tid);
+    }
+}
+
+
+uthread_task_group::~uthread_task_group()
+{
+    wait();
+    core.block_timer();
+    closing = true;
+    // A worker resumed by uthread_resume is already READY, and one blocked by uthread_block ends
+    // once it is resumed.
+    for (unsigned int i=0; i<idle.size(); i++)
+    {
+        if (core.threads[idle[i]]->getState() == BLOCKED && !core.threads[idle[i]]->is_explicitly_blocked())
+        {
+            core.threads[idle[i]]->setState(READY);
+            core.push_ready(idle[i]);
+        }
+    }
+    idle.clear();
+    core.unblock_timer();
+    for (unsigned int i=0; i<workers.size(); i++)
+    {
+        uthread_join(workers[i], nullptr);
+    }
+}
+
+
+int uthread_task_group::submit(void (*run)(void *), void (*relocate)(void *, void *),
+                               void (*destroy)(void *), void *closure)
+{
+    library_safepoint();
+    core.block_timer();
+    if (workers.empty())
+    {
+        std::cerr << LIB_ERROR_MSG << "the task group has no workers.\n";
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    tasks.emplace_back();
+    task &added = tasks.back();
+    added.run = run;
+    added.relocate = relocate;
+    added.destroy = destroy;
+    relocate(added.closure, closure);
+    pending++;
+    // Skips the idle workers that are already READY or blocked by uthread_block.
+    for (int i=(int)idle.size() - 1; i>=0; i--)
+    {
+        int worker = idle[i];
+        if (core.threads[worker]->getState() == BLOCKED && !core.threads[worker]->is_explicitly_blocked())
+        {
+            idle.erase(idle.begin() + i);
+            core.threads[worker]->setState(READY);
+            core.push_ready(worker);
+            break;
+        }
+    }
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+int uthread_task_group::wait()
+{
+    library_safepoint();
+    core.block_timer();
+    if (std::find(workers.begin(), workers.end(), core.running_tid) != workers.end())
+    {
+        std::cerr << LIB_ERROR_MSG << "a worker cannot wait for its own task group.\n";
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    else if (waiter != NO_THREAD)
+    {
+        std::cerr << LIB_ERROR_MSG << "another thread is waiting for the task group.\n";
+        core.unblock_timer();
+        return FAIL_CODE;
+    }
+    // Resuming the waiter does not end the wait.
+    while (pending > 0)
+    {
+        waiter = core.running_tid;
+        core.threads[core.running_tid]->setState(BLOCKED);
+        core.suspend_running_thread();
+    }
+    waiter = NO_THREAD;
+    core.unblock_timer();
+    return SUCCESS_CODE;
+}
+
+
+void uthread_task_group::work(void *group)
+{
+    uthread_task_group *self = static_cast<uthread_task_group *>(group);
+    core.block_timer();
+    while (!self->closing)
+    {
+        if (self->tasks.empty())
+        {
+            self->idle.push_back(core.running_tid);
+            core.threads[core.running_tid]->setState(BLOCKED);
+            core.suspend_running_thread();
+            // A worker resumed by uthread_resume is still in the idle list.
+            self->idle.erase(std::remove(self->idle.begin(), self->idle.end(), core.running_tid),
+                             self->idle.end());
+            continue;
+        }
+        // The task is moved to the stack of the worker, so other workers may take the next ones.
+        task &next = self->tasks.front();
+        alignas(UTHREAD_CLOSURE_ALIGNMENT) char closure[UTHREAD_CLOSURE_SIZE];
+        void (*run)(void *) = next.run;
+        next.relocate(closure, next.closure);
+        next.destroy(next.closure);
+        self->tasks.pop_front();
+        core.unblock_timer();
+        run(closure);
+        core.block_timer();
+        // The worker finishing the last task hands the waiter straight to the ready queue.
+        if (--self->pending == 0 && self->waiter != NO_THREAD &&
+            core.threads[self->waiter]->getState() == BLOCKED && !core.threads[self->waiter]->is_explicitly_blocked())
+        {
+            core.threads[self->waiter]->setState(READY);
+            core.push_ready(self->waiter);
+        }
+    }
+    core.unblock_timer();
+}
@@ -6,8 +6,90 @@
  * Author: OS, os@cs.huji.ac.il
  */
 
+/*
+ * Each of the limits below can be overridden at compile time (-D), as a plain
+ * number, to build a library specialized for one program. The library and the
+ * program must be compiled with the same values, or the program fails to link.
+ * With PRIORITY_LEVELS set to 1, scheduling is plain round-robin with no level
+ * bookkeeping. The scheduler itself is the template in scheduler.h, which a
+ * program may instantiate with policies of its own.
+ */
+#ifndef MAX_THREAD_NUM
 #define MAX_THREAD_NUM 100 /* maximal number of threads */
-#define STACK_SIZE 4096 /* stack size per thread (in bytes) */
+#endif
+#ifndef STACK_SIZE
+#define STACK_SIZE 16384 /* stack size per thread (in bytes), scheduling runs on it */
+#endif
+#ifndef ARENA_SIZE
+#define ARENA_SIZE 8192 /* arena size per thread for uthread_alloc (in bytes) */
+#endif
+#ifndef MAX_LOCAL_KEYS
+#define MAX_LOCAL_KEYS 64 /* maximal number of thread-local storage keys */
+#endif
+#ifndef PRIORITY_LEVELS
+#define PRIORITY_LEVELS 8 /* number of scheduling levels, 0 is the highest, at most 32 */
+#endif
+#ifndef AGING_PERIOD
+#define AGING_PERIOD 50 /* number of quanta between two raises of every READY thread */
+#endif
+#ifndef UTHREAD_CLOSURE_SIZE
+#define UTHREAD_CLOSURE_SIZE 64 /* bytes of a callable stored inside the thread by uthread_spawn */
+#endif
+
+/*
+ * The interval timer that measures quanta, and the signal it raises. They can
+ * only be overridden together, e.g. with ITIMER_REAL and SIGALRM to measure
+ * quanta in real time.
+ */
+#if defined(UTHREAD_TIMER) != defined(UTHREAD_TIMER_SIGNAL)
+#error "UTHREAD_TIMER and UTHREAD_TIMER_SIGNAL must be overridden together"
+#endif
+#ifndef UTHREAD_TIMER
+#define UTHREAD_TIMER ITIMER_VIRTUAL
+#define UTHREAD_TIMER_SIGNAL SIGVTALRM
+#endif
+
+/*
+ * Each of the features below can be compiled away by setting it to 0. The
+ * scheduler then skips it with no cost at run time, and its functions fail.
+ */
+#ifndef UTHREAD_DEADLINES
+#define UTHREAD_DEADLINES 1 /* earliest-deadline-first scheduling, see uthread_set_deadline */
+#endif
+#ifndef UTHREAD_SIMULATED_CLOCK
+#define UTHREAD_SIMULATED_CLOCK 1 /* quanta measured in ticks, see uthread_init_simulated */
+#endif
+#ifndef UTHREAD_INBOX
+#define UTHREAD_INBOX 1 /* requests from other pthreads, see uthread_post_spawn */
+#endif
+
+/*
+ * If UTHREAD_STATS_SINK is defined (-DUTHREAD_STATS_SINK=name), the program
+ * must define a function with that name, which the library calls with the ID
+ * of each thread that starts a quantum and the total number of quanta. It may
+ * be called from a signal handler, so it must be async-signal-safe.
+ */
+#ifdef UTHREAD_STATS_SINK
+void UTHREAD_STATS_SINK(int tid, int total_quanta);
+#endif
+
+#define UTHREAD_MAX_ALLOC 1024 /* maximal block size of uthread_alloc (in bytes) */
+#define UTHREAD_CLOSURE_ALIGNMENT 16 /* maximal alignment of a callable stored inside the thread */
+
+/*
+ * A symbol named after the limits, defined by the library and referenced by
+ * every program that includes this header.
+ */
+#define UTHREAD_CONFIG_NAME(threads, stack, arena, keys, levels, aging, closure) \
+    uthread_config_##threads##_##stack##_##arena##_##keys##_##levels##_##aging##_##closure
+#define UTHREAD_CONFIG_EXPAND(threads, stack, arena, keys, levels, aging, closure) \
+    UTHREAD_CONFIG_NAME(threads, stack, arena, keys, levels, aging, closure)
+#define UTHREAD_CONFIG_SYMBOL UTHREAD_CONFIG_EXPAND(MAX_THREAD_NUM, STACK_SIZE, ARENA_SIZE, MAX_LOCAL_KEYS, \
+                                                    PRIORITY_LEVELS, AGING_PERIOD, UTHREAD_CLOSURE_SIZE)
+extern int UTHREAD_CONFIG_SYMBOL;
+static int *const uthread_config_check __attribute__((used)) = &UTHREAD_CONFIG_SYMBOL;
+
+#include <stddef.h>
 
 /* External interface */
 
@@ -26,19 +108,66 @@ void print_thread_status();
 */
 int uthread_init(int quantum_usecs);
 
+/*
+ * Description: This function initializes the thread library in simulated-clock
+ * mode, as an alternative to uthread_init. Quanta are measured in ticks of a
+ * simulated clock instead of the virtual timer: every library call advances
+ * the clock by one tick, and uthread_tick advances it explicitly. When a quantum
+ * is over, the running thread is preempted at that point exactly as on timer
+ * expiration. If seed is non-zero, the next thread to run is picked from the
+ * READY threads list by a generator seeded with seed, so a run can be replayed
+ * by reusing the same seed. A seed of 0 keeps the round-robin order.
+ * It is an error to call this function with non-positive quantum_ticks.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_init_simulated(int quantum_ticks, unsigned int seed);
+
+/*
+ * Description: This function advances the simulated clock by the given number
+ * of ticks. If the quantum of the RUNNING thread is over, a scheduling decision
+ * is made. It is an error to call this function if the library was not
+ * initialized with uthread_init_simulated.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_tick(unsigned int ticks);
+
 /*
  * Description: This function creates a new thread, whose entry point is the
  * function f with the signature void f(void). The thread is added to the end
  * of the READY threads list. The uthread_spawn function should fail if it
  * would cause the number of concurrent threads to exceed the limit
  * (MAX_THREAD_NUM). Each thread should be allocated with a stack of size
- * STACK_SIZE bytes.
+ * STACK_SIZE bytes. When f returns, the thread exits as if it called
+ * uthread_exit(nullptr).
  * Return value: On success, return the ID of the created thread.
  * On failure, return -1.
 */
 int uthread_spawn(void (*f)(void));
 
 
+/*
+ * Description: This function creates a new thread, as uthread_spawn does,
+ * whose entry point is the function f called with arg. The library does not
+ * allocate anything for arg.
+ * Return value: On success, return the ID of the created thread.
+ * On failure, return -1.
+*/
+int uthread_spawn_arg(void (*f)(void *), void *arg);
+
+
+/*
+ * Description: This function creates a new thread, as uthread_spawn does,
+ * that runs a callable stored inside the thread itself. relocate(dst, src)
+ * is called once to move the callable from closure to the
+ * UTHREAD_CLOSURE_SIZE bytes at dst, aligned to UTHREAD_CLOSURE_ALIGNMENT,
+ * and the thread then runs run(dst). It is used by the uthread_spawn
+ * template below.
+ * Return value: On success, return the ID of the created thread.
+ * On failure, return -1.
+*/
+int uthread_spawn_closure(void (*run)(void *), void (*relocate)(void *, void *), void *closure);
+
+
 /*
  * Description: This function terminates the thread with ID tid and deletes
  * it from all relevant control structures. All the resources allocated by
@@ -53,6 +182,56 @@ int uthread_spawn(void (*f)(void));
 int uthread_terminate(int tid);
 
 
+/*
+ * Description: This function ends the RUNNING thread with the given exit
+ * value. The value is delivered to every thread waiting in uthread_join for
+ * the exiting thread, and they are moved to the end of the READY threads
+ * list. If no thread is waiting, the exiting thread keeps its ID until it is
+ * joined or detached, unless it is detached already. Exiting the main thread
+ * (tid == 0) is the same as terminating it.
+ * Return value: The function does not return.
+*/
+void uthread_exit(void *value);
+
+
+/*
+ * Description: This function waits for the thread with ID tid to exit. If the
+ * thread did not exit yet, the calling thread is BLOCKED and a scheduling
+ * decision is made. The exit value of the thread is stored in value, unless
+ * value is nullptr, and the thread ID is released. A thread terminated by
+ * uthread_terminate while being waited for has the exit value nullptr.
+ * It is an error to join a thread that does not exist, the calling thread,
+ * the main thread or a detached thread.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_join(int tid, void **value);
+
+
+/*
+ * Description: This function waits for any of the count threads whose IDs
+ * are in tids to exit, and joins the first one that does, as uthread_join
+ * does. Its ID is stored in joined and its exit value in value, unless they
+ * are nullptr. Unlike uthread_join, resuming the calling thread with
+ * uthread_resume ends the wait without joining any thread, and joined is
+ * then set to -1. It is an error to call this function with non-positive
+ * count, or with an ID that uthread_join would reject, in which case that ID
+ * is stored in joined and no thread is waited for.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_join_any(const int *tids, int count, int *joined, void **value);
+
+
+/*
+ * Description: This function detaches the thread with ID tid, so its ID is
+ * released as soon as it exits instead of when it is joined. Detaching a
+ * thread that already exited releases its ID. It is an error to detach a
+ * thread that does not exist, the main thread or a thread that other threads
+ * are waiting to join.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_detach(int tid);
+
+
 /*
  * Description: This function blocks the thread with ID tid. The thread may
  * be resumed later using uthread_resume. If no thread with ID tid exists it
@@ -65,6 +244,40 @@ int uthread_terminate(int tid);
 int uthread_block(int tid);
 
 
+/*
+ * Description: This function creates count new threads, whose entry points
+ * are fs[0], ..., fs[count-1], and stores their IDs in tids, in the same
+ * order. The threads are added to the end of the READY threads list together,
+ * in that order. The function should fail, without creating any thread, if it
+ * would cause the number of concurrent threads to exceed the limit
+ * (MAX_THREAD_NUM). It is an error to call this function with negative count.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_spawn_n(void (**fs)(void), int count, int *tids);
+
+
+/*
+ * Description: This function blocks the count threads whose IDs are in tids,
+ * as uthread_block does for each of them. If any of the IDs may not be
+ * blocked, none of the threads is blocked. If the calling thread is one of
+ * them, a scheduling decision is made after all others are blocked. It is an
+ * error to call this function with negative count.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_block_many(const int *tids, int count);
+
+
+/*
+ * Description: This function resumes the count threads whose IDs are in
+ * tids, as uthread_resume does for each of them. The blocked threads among
+ * them are added to the end of the READY threads list together, in the order
+ * of tids. If no thread exists for any of the IDs, none of the threads is
+ * resumed. It is an error to call this function with negative count.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_resume_many(const int *tids, int count);
+
+
 /*
  * Description: This function resumes a blocked thread with ID tid and moves
  * it to the READY state. Resuming a thread in a RUNNING or READY state
@@ -84,6 +297,99 @@ int uthread_resume(int tid);
 int uthread_sleep(unsigned int usec);
 
 
+/*
+ * Description: This function sets the priority of the thread with ID tid,
+ * and moves it to the level of that priority. Threads are scheduled by a
+ * multi-level feedback queue: the next thread to run is the first in the
+ * READY threads list of the highest level that has READY threads. A thread
+ * that uses its whole quantum moves down a level, and a thread that blocks
+ * itself moves up a level, but not above its priority. Every AGING_PERIOD
+ * quanta, every READY thread moves up a level so low levels are not starved.
+ * Threads are created with priority 0, the highest. It is an error to set a
+ * priority outside of [0, PRIORITY_LEVELS - 1], or for a thread that does not
+ * exist.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_priority(int tid, int priority);
+
+
+/*
+ * Description: This function starts a new job for the thread with ID tid,
+ * whose deadline is usecs micro-seconds of real time from now, or usecs ticks
+ * when the library uses the simulated clock, and whose budget is quanta
+ * quanta. While its job has budget left, the thread is scheduled ahead of all
+ * threads without a deadline, by earliest deadline first, one quantum at a
+ * time, and every quantum it uses up is charged to the budget. A job that
+ * used up its budget is scheduled by the priority level of the thread until
+ * it ends. The job ends when the thread blocks itself, when it exits, when a
+ * new job is started, or when the thread is preempted past its deadline. A
+ * job that ends after its deadline counts as a missed deadline, and the
+ * thread goes back to being scheduled by its priority level. Setting usecs to
+ * 0 ends the current job without starting a new one, and quanta is then
+ * ignored. It is an error to start a job with non-positive quanta, or for a
+ * thread that does not exist.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_deadline(int tid, unsigned int usecs, int quanta);
+
+
+/*
+ * Description: This function returns the number of deadlines missed by the
+ * thread with ID tid. If no thread with ID tid exists it is considered an
+ * error.
+ * Return value: On success, return the number of missed deadlines of the
+ * thread with ID tid. On failure, return -1.
+*/
+int uthread_get_deadline_misses(int tid);
+
+
+/*
+ * Description: This function sets the quantum length of the thread with ID
+ * tid to quantum_usecs micro-seconds, or ticks when the library uses the
+ * simulated clock. A quantum_usecs of 0 restores the quantum length given to
+ * the library at initialization. The new length applies from the next
+ * quantum of the thread. It is an error to call this function with negative
+ * quantum_usecs, or if no thread with ID tid exists.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_quantum(int tid, int quantum_usecs);
+
+
+/*
+ * Description: This function turns adaptive quanta on (non-zero enabled) or
+ * off (enabled == 0). With adaptive quanta, every time a thread uses its
+ * whole quantum its next quanta get twice as long, and every time it blocks
+ * itself they get half as long, within a quarter and 4 times its quantum
+ * length.
+ * Return value: On success, return 0.
+*/
+int uthread_set_adaptive_quantum(int enabled);
+
+
+/*
+ * Description: This function turns cooperative preemption on (non-zero
+ * enabled) or off (enabled == 0). In cooperative mode, when the quantum of
+ * the RUNNING thread is over it is not switched right away. Instead it is
+ * switched at its next call to uthread_safepoint or to any other library
+ * function, except the init functions, and uthread_post_spawn and
+ * uthread_post_resume, which may run outside of the library's threads. A
+ * thread that does not reach such a call within margin_usecs micro-seconds
+ * after its quantum is over is preempted anyway. It is an
+ * error to turn cooperative mode on with non-positive margin_usecs.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_set_cooperative(int enabled, int margin_usecs);
+
+
+/*
+ * Description: This function lets the library switch the RUNNING thread if
+ * its quantum is over in cooperative mode. It is cheap when no switch is due,
+ * and can be called often in long computations.
+ * Return value: On success, return 0.
+*/
+int uthread_safepoint();
+
+
 /*
  * Description: This function returns the thread ID of the calling thread.
  * Return value: The ID of the calling thread.
@@ -114,5 +420,156 @@ int uthread_get_total_quantums();
 */
 int uthread_get_quantums(int tid);
 
-#endif
 
+/*
+ * Description: This function creates a new thread-local storage key and
+ * stores it in key. Every thread, existing or created later, starts with the
+ * value nullptr for the new key. The function should fail if it would cause
+ * the number of keys to exceed the limit (MAX_LOCAL_KEYS).
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_key_create(int *key);
+
+
+/*
+ * Description: This function sets the value of key for the calling thread.
+ * Other threads are not affected. It is an error to use a key that was not
+ * created by uthread_key_create.
+ * Return value: On success, return 0. On failure, return -1.
+*/
+int uthread_setspecific(int key, void *value);
+
+
+/*
+ * Description: This function returns the value of key for the calling thread.
+ * It is an error to use a key that was not created by uthread_key_create.
+ * Return value: On success, return the value last set by the calling thread,
+ * or nullptr if it never set one. On failure, return nullptr.
+*/
+void *uthread_getspecific(int key);
+
+
+/*
+ * Description: This function allocates size bytes for the calling thread.
+ * Blocks come from an arena kept next to the thread's stack, so allocation
+ * does not lock or touch the global heap, and is safe under preemption. The
+ * arena grows from the heap when it is full. All blocks of a thread are
+ * released when it is terminated. It is an error to allocate more than
+ * UTHREAD_MAX_ALLOC bytes.
+ * Return value: On success, return a pointer to the block, aligned to 16
+ * bytes. On failure, return nullptr.
+*/
+void *uthread_alloc(size_t size);
+
+
+/*
+ * Description: This function frees a block returned by uthread_alloc, so the
+ * calling thread can reuse it. A block must be freed by the thread that
+ * allocated it. Freeing nullptr has no effect.
+*/
+void uthread_free(void *block);
+
+
+/*
+ * Description: This function asks the library to create a new thread, whose
+ * entry point is the function f, as uthread_spawn does. Unlike all other
+ * library functions, it may be called from any pthread and from signal
+ * handlers. The request is applied at the next scheduling decision, or right
+ * away if no thread is READY, except that a thread is never created while
+ * preempting from the timer signal: that waits for the next switch made by
+ * a library call. Other pthreads must block the timer signal
+ * (UTHREAD_TIMER_SIGNAL). The ID of the new thread is not reported, and the
+ * request is dropped with an error message if the number of threads would
+ * exceed MAX_THREAD_NUM.
+ * Return value: On success, return 0. If too many requests are pending, or
+ * UTHREAD_INBOX is 0, return -1.
+*/
+int uthread_post_spawn(void (*f)(void));
+
+
+/*
+ * Description: This function asks the library to resume the thread with ID
+ * tid, as uthread_resume does. It may be called from any pthread and from
+ * signal handlers, and is applied at the next scheduling decision, or right
+ * away if no thread is READY.
+ * Return value: On success, return 0. If too many requests are pending, or
+ * UTHREAD_INBOX is 0, return -1.
+*/
+int uthread_post_resume(int tid);
+
+
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace uthread_detail
+{
+    template <typename F>
+    void run_inline(void *closure)
+    {
+        F &fn = *static_cast<F *>(closure);
+        fn();
+        fn.~F();
+    }
+
+    template <typename F>
+    void relocate(void *dst, void *src)
+    {
+        new (dst) F(std::move(*static_cast<F *>(src)));
+    }
+
+    template <typename F>
+    void destroy(void *closure)
+    {
+        static_cast<F *>(closure)->~F();
+    }
+
+    template <typename F>
+    struct fits_inline : std::integral_constant<bool, sizeof(F) <= UTHREAD_CLOSURE_SIZE &&
+                                                      alignof(F) <= UTHREAD_CLOSURE_ALIGNMENT> {};
+
+    template <typename F>
+    void run_allocated(void *closure)
+    {
+        F *fn = static_cast<F *>(closure);
+        (*fn)();
+        delete fn;
+    }
+
+    template <typename F>
+    int spawn(F &fn, std::true_type /* fits inline */)
+    {
+        return uthread_spawn_closure(run_inline<F>, relocate<F>, &fn);
+    }
+
+    template <typename F>
+    int spawn(F &fn, std::false_type /* fits inline */)
+    {
+        F *copy = new F(std::move(fn));
+        int tid = uthread_spawn_arg(run_allocated<F>, copy);
+        if (tid < 0)
+        {
+            delete copy;
+        }
+        return tid;
+    }
+}
+
+/*
+ * Description: This function creates a new thread, as uthread_spawn does,
+ * whose entry point is the callable fn, such as a lambda with captures. A
+ * callable of up to UTHREAD_CLOSURE_SIZE bytes is moved into the thread
+ * itself, so spawning it allocates nothing. A larger one is moved to the
+ * heap. The callable is destroyed when it returns, but not if the thread
+ * ends by uthread_exit or uthread_terminate.
+ * Return value: On success, return the ID of the created thread.
+ * On failure, return -1.
+*/
+template <typename F>
+int uthread_spawn(F fn)
+{
+    return uthread_detail::spawn(fn, uthread_detail::fits_inline<F>());
+}
+
+#endif